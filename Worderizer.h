@@ -1,11 +1,30 @@
 #pragma once
 #include <iostream>
 #include <string>
+#include <vector>
 #include <locale>
+#include <codecvt>
 #include <cstdint>
-#include <Windows.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#ifdef _WIN32
+    #include <Windows.h>
+#endif
 #include <parallel_hashmap/phmap.h>
 #include "ReadWrite.h"
+#include "AsyncReader.h"
+#include "AhoCorasick.h"
+#include "FileTasks.h"
+#include "Decompress.h"
+#include "HyperLogLog.h"
+#include "HugePageAlloc.h"
 
 namespace Worderizer {
 
@@ -22,12 +41,31 @@ namespace Worderizer {
     inline uint8_t MaxNumLen = 4;
     inline uint8_t MaxWordLen = 64;
     inline uint32_t MaxCharCode = 65536;
+    inline uint32_t PrefetchFiles = 4;
+    inline uint32_t MaxVocabSize = 0;
+    inline uint32_t ThreadCount = 0;
+    inline uint64_t TaskSize = 0; // bytes per scheduled file task, 0 picks a size from the corpus
+    inline uint64_t PresizeMinBytes = 256*1024*1024; // corpora this large get their count maps reserved up front
+    inline uint32_t LocalCountWords = 256*1024; // distinct words a build thread counts before moving them to the shared map
+    inline std::atomic<bool> UseHugePages(false); // back the large count tables with transparent huge pages
+
+    inline std::vector<std::u32string> PinnedWords;
+
+    // bumped by every function that changes a word map so caches know when to reset
+    inline std::atomic<uint64_t> WordMapVersion(0);
 
     inline std::vector<SubCharData> charSubTable;
 
     inline std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> cv_u8_u32;
     //std::wstring_convert<std::codecvt_utf16<char32_t>,char32_t> cv_u16_u32;
 
+    inline uint32_t GetThreadCount()
+    {
+        if (ThreadCount > 0) return ThreadCount;
+
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
     inline bool IsUTF8orASCII(const std::string& file_str)
     {
         uint8_t* chars = (uint8_t*)file_str.c_str();
@@ -95,6 +133,16 @@ namespace Worderizer {
         return result;
     }
 
+    inline bool NeedsNormalize(const std::u32string& str)
+    {
+        if (charSubTable.empty()) return false;
+
+        for (const char32_t& c : str)
+            if (IsInSubTable(c)) return true;
+
+        return false;
+    }
+
     inline bool IsAlpha(const uint32_t& c)
     {
         if ((c > 64 && c < 91) || (c > 96 && c < 123)) {
@@ -168,286 +216,1074 @@ namespace Worderizer {
         return haveWord;
     }
 
-    inline void SetMapIndices(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    struct MemoryReport
     {
-        uint32_t cIndex = 0;
+        std::string name;
+        size_t entries;
+        size_t capacity;
+        size_t tableBytes;
+        size_t heapBytes;
+        double loadFactor;
+        double avgKeyLen;
 
-        for (auto it = words.begin(); it != words.end();)
+        MemoryReport() : entries(0), capacity(0), tableBytes(0), heapBytes(0), loadFactor(0), avgKeyLen(0) {};
+
+        size_t TotalBytes() const { return tableBytes + heapBytes; }
+    };
+
+    // bytes allocated outside the string object, short strings live inside it and cost nothing extra
+    template <typename CharT>
+    inline size_t StringHeapBytes(const std::basic_string<CharT>& str)
+    {
+        const char* data = (const char*)str.data();
+        const char* self = (const char*)&str;
+
+        if (data >= self && data < self + sizeof(str)) return 0;
+
+        return (str.capacity() + 1) * sizeof(CharT);
+    }
+
+    // estimate for flat maps: one slot plus one control byte per unit of capacity, plus out-of-line keys
+    template <typename Map>
+    inline MemoryReport GetMemoryReport(const Map& map, const std::string& name)
+    {
+        MemoryReport report;
+        size_t totalKeyLen = 0;
+
+        report.name = name;
+        report.entries = map.size();
+        report.capacity = map.capacity();
+        report.tableBytes = sizeof(Map) + report.capacity * (sizeof(typename Map::value_type) + 1);
+
+        for (const auto& n : map)
         {
-            if (it->second >= MinOccurr) {
-                it->second = cIndex++;
-                it++;
-            } else {
-                it = words.erase(it);
-            }
+            report.heapBytes += StringHeapBytes(n.first);
+            totalKeyLen += n.first.length();
         }
 
-        if (words.size() > UINT32_MAX)
-            HandleFatalError("Word count exceeded UINT32_MAX");
+        if (report.capacity > 0) report.loadFactor = (double)report.entries / report.capacity;
+        if (report.entries > 0) report.avgKeyLen = (double)totalKeyLen / report.entries;
+
+        return report;
     }
 
-    inline void GenEnglishWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string data_dir, bool set_indices=true)
+    inline MemoryReport GetMemoryReport(const std::vector<std::u32string>& token_table, const std::string& name)
     {
-        std::u32string word, fileText;
-        std::string fileStr;
-        bool isNumber = false;
-        bool nextChar = false;
-        bool isFirstChar = true;
-        char32_t tempChar = 0;
+        MemoryReport report;
+        size_t totalKeyLen = 0;
 
-        for (char32_t i=32; i < 127; ++i)
+        report.name = name;
+        report.entries = token_table.size();
+        report.capacity = token_table.capacity();
+        report.tableBytes = sizeof(token_table) + report.capacity * sizeof(std::u32string);
+
+        for (const auto& word : token_table)
         {
-            word.assign(1, i);
-            words[word] = MinOccurr;
+            report.heapBytes += StringHeapBytes(word);
+            totalKeyLen += word.length();
         }
 
-        std::vector<std::string> files(ListFiles(data_dir));
+        if (report.capacity > 0) report.loadFactor = (double)report.entries / report.capacity;
+        if (report.entries > 0) report.avgKeyLen = (double)totalKeyLen / report.entries;
 
-        for (const std::string& filePath : files)
-        {
-            std::cout << "Reading file: " << filePath << std::endl;
+        return report;
+    }
 
-            fileStr = ReadFileStr(filePath);
+    inline MemoryReport GetSubTableMemory()
+    {
+        MemoryReport report;
+        size_t totalSubLen = 0;
 
-            if (IsUTF8orASCII(fileStr)) {
-                fileText = cv_u8_u32.from_bytes(fileStr.data());
-            } else {
-                continue;
+        report.name = "char sub table";
+        report.capacity = charSubTable.capacity();
+        report.tableBytes = sizeof(charSubTable) + report.capacity * sizeof(SubCharData);
+
+        for (const SubCharData& data : charSubTable)
+        {
+            report.heapBytes += StringHeapBytes(data.sub);
+
+            if (data.use) {
+                report.entries++;
+                totalSubLen += data.sub.length();
             }
+        }
 
-            isFirstChar = true;
-            nextChar = false;
+        if (report.capacity > 0) report.loadFactor = (double)report.entries / report.capacity;
+        if (report.entries > 0) report.avgKeyLen = (double)totalSubLen / report.entries;
 
-            for (const char32_t& c : fileText)
-            {
-                tempChar = c;
+        return report;
+    }
 
-                while(true)
-                {
-                    if (UpdateWord(word, isFirstChar, isNumber, nextChar, tempChar)) {
+    inline void PrintMemoryReport(const MemoryReport& report)
+    {
+        std::cout << report.name << ": " << report.TotalBytes() << " bytes ("
+                  << report.tableBytes << " table, " << report.heapBytes << " keys), "
+                  << report.entries << " entries, capacity " << report.capacity
+                  << ", load factor " << report.loadFactor
+                  << ", avg key length " << report.avgKeyLen << std::endl;
+    }
 
-                        isFirstChar = true;
+    // rebuilds the map at the smallest capacity that fits, copying keys also drops their spare capacity
+    template <typename Map>
+    inline void Compact(Map& map)
+    {
+        Map compacted;
+        compacted.reserve(map.size());
 
-                        if (words.contains(word)) {
-                            if (words[word] < UINT32_MAX)
-                                words[word] += 1;
-                        } else {
-                            words[word] = 1;
-                        }
+        for (const auto& n : map)
+            compacted.emplace(typename Map::key_type(n.first.data(), n.first.size()), n.second);
 
-                        if (nextChar) {
-                            nextChar = false;
-                            continue;
-                        }
-                    }
+        map.swap(compacted);
+    }
 
-                    break;
-                }
-            }
+    inline void CompactSubTable()
+    {
+        size_t tableSize = charSubTable.size();
 
-            std::cout << "Word Count: " << words.size() << std::endl;
-        }
+        while (tableSize > 0 && !charSubTable[tableSize-1].use) tableSize--;
 
-        if (set_indices) SetMapIndices(words);
+        charSubTable.resize(tableSize);
+        charSubTable.shrink_to_fit();
+    }
 
-        //for (const auto& n : words)
-            //std::cout << cv_u8_u32.to_bytes(n.first) << ": " << n.second << std::endl;
+    // only worth the copy once most of the table is empty, e.g. after pruning a count map
+    template <typename Map>
+    inline void CompactIfSparse(Map& map)
+    {
+        if (map.size() < map.capacity() / 4) Compact(map);
+    }
 
-        std::cout << "Final Word Count: " << words.size() << std::endl;
+    struct WordCount
+    {
+        uint32_t count;
+        uint32_t order;
+        const std::u32string* word;
+    };
+
+    inline bool MoreFrequent(const WordCount& a, const WordCount& b)
+    {
+        if (a.count != b.count) return a.count > b.count;
+
+        return *a.word < *b.word;
     }
 
-    inline void GenEnglishWordMapAlt(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string data_dir, bool set_indices=true)
+    inline void SetMapIndicesTopK(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                                  size_t max_words, const std::vector<std::u32string>& pinned_words)
     {
-        std::u32string word, fileText;
-        std::string fileStr;
-        bool isNumber = false;
-        bool nextChar = false;
-        bool isFirstChar = true;
-        char32_t tempChar = 0;
+        WordMapVersion++;
 
-        phmap::parallel_flat_hash_map<std::u32string, bool> wordsAlt;
+        // pinned words are kept even if the corpus never contained them, e.g. control tokens
+        for (const auto& word : pinned_words)
+            if (!word.empty()) words.try_emplace(word, 0);
 
-        std::vector<std::string> files(ListFiles(data_dir));
+        std::vector<WordCount> keepWords, candidates;
+        std::vector<uint32_t> newIndices(words.size(), UINT32_MAX);
+        phmap::parallel_flat_hash_map<std::u32string, bool> pinnedMap;
+        uint32_t order = 0;
 
-        for (const std::string& filePath : files)
-        {
-            std::cout << "Reading file: " << filePath << std::endl;
+        for (const auto& word : pinned_words) pinnedMap[word] = true;
+
+        if (words.size() > UINT32_MAX)
+            HandleFatalError("Word count exceeded UINT32_MAX");
 
-            fileStr = ReadFileStr(filePath);
+        for (const auto& n : words)
+        {
+            bool isPinned = (n.first.length() == 1 && n.first[0] > 31 && n.first[0] < 127) ||
+                pinnedMap.contains(n.first);
 
-            if (IsUTF8orASCII(fileStr)) {
-                fileText = cv_u8_u32.from_bytes(fileStr.data());
+            if (isPinned) {
+                keepWords.push_back({n.second, order++, &n.first});
             } else {
-                continue;
+                candidates.push_back({n.second, order++, &n.first});
             }
+        }
 
-            wordsAlt.clear();
-            isFirstChar = true;
-            nextChar = false;
+        size_t topCount = (keepWords.size() < max_words) ? max_words - keepWords.size() : 0;
 
-            for (const char32_t& c : fileText)
-            {
-                tempChar = c;
+        if (topCount < candidates.size()) {
 
-                while(true)
-                {
-                    if (UpdateWord(word, isFirstChar, isNumber, nextChar, tempChar)) {
+            // each shard keeps its own top K, the true top K is among the survivors
+            size_t shardCount = std::min<size_t>(GetThreadCount(), candidates.size() / std::max<size_t>(topCount, 1));
+            if (shardCount < 1) shardCount = 1;
 
-                        isFirstChar = true;
+            size_t shardSize = (candidates.size() + shardCount - 1) / shardCount;
+            std::vector<size_t> shardKept(shardCount, 0);
+            std::vector<std::thread> threads;
 
-                        if (!wordsAlt.contains(word))
-                            wordsAlt[word] = true;
+            for (size_t t=0; t < shardCount; ++t)
+            {
+                threads.emplace_back([&, t] {
+                    auto first = candidates.begin() + std::min(t * shardSize, candidates.size());
+                    auto last = candidates.begin() + std::min((t+1) * shardSize, candidates.size());
+                    size_t keep = std::min<size_t>(topCount, last - first);
 
-                        if (nextChar) {
-                            nextChar = false;
-                            continue;
-                        }
-                    }
+                    if (keep < (size_t)(last - first)) std::nth_element(first, first + keep, last, MoreFrequent);
 
-                    break;
-                }
+                    shardKept[t] = keep;
+                });
             }
 
-            for (const auto& n : wordsAlt)
+            for (std::thread& thread : threads) thread.join();
+
+            size_t merged = 0;
+
+            for (size_t t=0; t < shardCount; ++t)
             {
-                if (words.contains(n.first)) {
-                    if (words[n.first] < UINT32_MAX)
-                        words[n.first] += 1;
-                } else {
-                    words[n.first] = 1;
-                }
+                auto first = candidates.begin() + std::min(t * shardSize, candidates.size());
+                merged = std::move(first, first + shardKept[t], candidates.begin() + merged) - candidates.begin();
             }
 
-            std::cout << "Word Count: " << words.size() << std::endl;
-        }
-
-        if (set_indices) SetMapIndices(words);
+            candidates.resize(merged);
 
-        std::cout << "Final Word Count: " << words.size() << std::endl;
-    }
+            if (topCount < candidates.size()) {
+                std::nth_element(candidates.begin(), candidates.begin() + topCount, candidates.end(), MoreFrequent);
+                candidates.resize(topCount);
+            }
+        }
 
-    inline void SaveWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string map_file)
-    {
-        std::string wordStr, tempStr;
-        std::vector<std::u32string> wordVec;
-        wordVec.resize(words.size());
+        keepWords.insert(keepWords.end(), candidates.begin(), candidates.end());
+        std::sort(keepWords.begin(), keepWords.end(), MoreFrequent);
 
-        for (const auto& n : words) wordVec[n.second] = n.first;
+        for (size_t i=0; i < keepWords.size(); ++i) newIndices[keepWords[i].order] = i;
 
-        FILE* pFile = fopen(map_file.c_str(), "wb");
-        if (pFile == NULL) HandleFatalError("Failed to create "+map_file);
+        order = 0;
 
-        for (const std::u32string& word : wordVec)
+        for (auto it = words.begin(); it != words.end();)
         {
-            try {
-                tempStr.assign(cv_u8_u32.to_bytes(word));
-                wordStr.assign(1, tempStr.length());
-                wordStr += tempStr;
-                fwrite(wordStr.data(), 1, wordStr.size(), pFile);
+            if (newIndices[order++] != UINT32_MAX) {
+                it->second = newIndices[order-1];
+                it++;
+            } else {
+                it = words.erase(it);
+            }
+        }
 
-            } catch (std::range_error& exception) {
+        CompactIfSparse(words);
+    }
 
-                std::cout << "Corrupt word detected. Contains characters: " << word.length() << std::endl;
+    inline void SetMapIndices(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    {
+        WordMapVersion++;
 
-                for (const auto& c : word) std::cout << "Char code: " << c << std::endl;
+        uint32_t cIndex = 0;
 
-                std::string userIn;
-                std::cout << "Skip word and continue saving word map? (type Y for yes) ";
-                std::cin >> userIn;
+        if (MaxVocabSize > 0) {
+            SetMapIndicesTopK(words, MaxVocabSize, PinnedWords);
+            return;
+        }
 
-                if (StrToUpper(userIn) != "Y") exit(EXIT_FAILURE);
+        for (auto it = words.begin(); it != words.end();)
+        {
+            if (it->second >= MinOccurr) {
+                it->second = cIndex++;
+                it++;
+            } else {
+                it = words.erase(it);
             }
         }
 
-        fclose(pFile);
+        if (words.size() > UINT32_MAX)
+            HandleFatalError("Word count exceeded UINT32_MAX");
 
-        std::cout << "Saved word map to " << map_file << std::endl;
+        CompactIfSparse(words);
     }
 
-    inline void LoadWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string map_file)
+    struct WordState
     {
         std::u32string word;
-        std::string wordStr;
-        uint32_t wordIndex = 0;
-        uint8_t wordSize = 0;
+        bool isNumber;
+        bool nextChar;
+        bool isFirstChar;
 
-        words.clear();
+        WordState() : isNumber(false), nextChar(false), isFirstChar(true) {};
+    };
 
-        FILE* pFile = fopen(map_file.c_str(), "rb");
-        if (pFile == NULL) HandleFatalError("Failed to open "+map_file);
+    // count map used while building, large tables can be backed by huge pages (see UseHugePages)
+    using CountMap = phmap::parallel_flat_hash_map<std::u32string, uint32_t,
+                                                   phmap::priv::hash_default_hash<std::u32string>,
+                                                   phmap::priv::hash_default_eq<std::u32string>,
+                                                   HugePageAllocator<std::pair<const std::u32string, uint32_t>>>;
+
+    // count map shared by the build threads, each of the 64 submaps has its own lock
+    using SharedCountMap = phmap::parallel_flat_hash_map<std::u32string, uint32_t,
+                                                         phmap::priv::hash_default_hash<std::u32string>,
+                                                         phmap::priv::hash_default_eq<std::u32string>,
+                                                         HugePageAllocator<std::pair<const std::u32string, uint32_t>>,
+                                                         6, std::mutex>;
+
+    // calls emit(word) for every word in text, state keeps a word that continues into the next call
+    template <typename Emit>
+    inline void ForEachWord(const char32_t* text, size_t length, WordState& state, Emit&& emit)
+    {
+        char32_t tempChar = 0;
 
-        while (fread(&wordSize, 1, 1, pFile))
+        for (size_t c=0; c < length; ++c)
         {
-            wordStr.resize(wordSize);
+            tempChar = text[c];
 
-            if (fread(wordStr.data(), 1, wordSize, pFile)) {
-                word = cv_u8_u32.from_bytes(wordStr.data());
-                words[word] = wordIndex++;
-            } else {
-                HandleFatalError("Corrupt wordmap file detected");
+            while(true)
+            {
+                if (UpdateWord(state.word, state.isFirstChar, state.isNumber, state.nextChar, tempChar)) {
+
+                    state.isFirstChar = true;
+
+                    emit(state.word);
+
+                    if (state.nextChar) {
+                        state.nextChar = false;
+                        continue;
+                    }
+                }
+
+                break;
             }
         }
+    }
 
-        fclose(pFile);
-
-        std::cout << "Loaded word map with " << words.size() << " tokens" << std::endl;
+    // adds the words in text to a count map, state keeps a word that continues into the next call
+    template <typename Map>
+    inline void CountWords(const char32_t* text, size_t length, Map& words, WordState& state)
+    {
+        ForEachWord(text, length, state, [&words](const std::u32string& word) {
+            auto it = words.try_emplace(word, 0).first;
+            if (it->second < UINT32_MAX) it->second++;
+        });
     }
 
-    inline void DelWordsFromMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
-                              std::vector<std::u32string> del_words)
+    // Calls emit(word) for the words of a decompressed stream while the next chunk is decompressed. Text is only
+    // decoded up to the last whitespace of what arrived so far, so no character or word is cut between chunks.
+    // Returns false if the stream was corrupt, files that aren't UTF8 are skipped like in GenEnglishWordMap.
+    // read_bytes gets the number of decompressed bytes that were scanned added to it.
+    template <typename Emit>
+    inline bool ForEachWordInStream(DecompressReader& stream, Emit&& emit, uint64_t* read_bytes=nullptr)
     {
-        bool foundWord = false;
-        uint32_t wordIndex = 0;
+        thread_local std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> converter;
+        std::string pending;
+        std::u32string text;
+        WordState wordState;
+        bool firstChunk = true;
 
-        for (auto it = words.begin(); it != words.end();)
-        {
-            for (const auto& word : del_words)
-            {
-                if (it->first == word) {
-                    it = words.erase(it);
-                    foundWord = true;
-                    break;
-                }
+        auto scanPiece = [&](size_t size) {
+            try {
+                text = converter.from_bytes(pending.data(), pending.data() + size);
+            } catch (std::range_error&) {
+                return;
             }
 
-            if (foundWord) {
-                foundWord = false;
-            } else {
-                it++;
+            ForEachWord(text.data(), text.length(), wordState, emit);
+        };
+
+        while (const std::string* chunk = stream.Next())
+        {
+            if (firstChunk && !IsUTF8orASCII(chunk->substr(0, 2))) return stream.Ok();
+
+            firstChunk = false;
+
+            if (read_bytes != nullptr) *read_bytes += chunk->size();
+
+            // pending holds no whitespace before the new chunk, so only the new bytes are searched
+            size_t scanStart = pending.size();
+            pending.append(*chunk);
+
+            size_t cutPos = pending.size();
+            while (cutPos > scanStart && !isspace((uint8_t)pending[cutPos-1])) cutPos--;
+
+            // a long run without whitespace is cut before its last char, the word state carries the word over
+            if (cutPos == scanStart && pending.size() >= 1024*1024) {
+                cutPos = pending.size() - 1;
+                while (cutPos > 0 && ((uint8_t)pending[cutPos] & 0xC0) == 0x80) cutPos--;
+            } else if (cutPos == scanStart) {
+                continue;
             }
+
+            if (cutPos == 0) continue;
+
+            scanPiece(cutPos);
+            pending.erase(0, cutPos);
         }
 
-        for (auto& n : words) n.second = wordIndex++;
+        if (!pending.empty()) scanPiece(pending.size());
+
+        return stream.Ok();
     }
 
-    inline void AddWordsToMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
-                              std::vector<std::u32string> new_words)
+    // adds the words of a decompressed stream to a count map, see ForEachWordInStream
+    template <typename Map>
+    inline bool CountWordsInStream(DecompressReader& stream, Map& words)
     {
-        uint32_t wordIndex = words.size();
+        return ForEachWordInStream(stream, [&words](const std::u32string& word) {
+            auto it = words.try_emplace(word, 0).first;
+            if (it->second < UINT32_MAX) it->second++;
+        });
+    }
 
-        if (wordIndex + new_words.size() > UINT32_MAX)
-            HandleFatalError("Size of merged map cannot exceed UINT32_MAX");
+    inline void AddBaseChars(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    {
+        for (char32_t i=32; i < 127; ++i)
+            words[std::u32string(1, i)] = MinOccurr;
+    }
 
-        for (const auto& word : new_words)
+    // first position at or after pos where the word state is reset, any ASCII whitespace ends a word
+    inline size_t NextWordBoundary(const char* data, size_t size, size_t pos)
+    {
+        if (pos == 0) return 0;
+
+        while (pos < size && !isspace((uint8_t)data[pos-1])) pos++;
+
+        return std::min(pos, size);
+    }
+
+    // adds the counts of src to a map shared between threads and empties src, counts saturate at UINT32_MAX
+    inline void FlushWordCounts(SharedCountMap& dest, CountMap& src)
+    {
+        for (const auto& n : src)
         {
-            if (words.contains(word)) continue;
+            dest.try_emplace_l(n.first, [&n](auto& entry) {
+                entry.second = (uint32_t)std::min<uint64_t>((uint64_t)entry.second + n.second, UINT32_MAX);
+            }, n.second);
+        }
 
-            words[word] = wordIndex++;
+        src.clear();
+    }
 
-            std::cout << "Added " << U32ToU8(word) << " to word map" << std::endl;
+    // adds the counts of src to dest and empties src, counts saturate at UINT32_MAX
+    template <typename Map>
+    inline void MergeWordCounts(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& dest, Map& src)
+    {
+        for (const auto& n : src)
+        {
+            auto it = dest.try_emplace(n.first, 0).first;
+            it->second = (uint32_t)std::min<uint64_t>((uint64_t)it->second + n.second, UINT32_MAX);
         }
 
-        std::cout << "Final word count " << words.size() << std::endl;
+        Map().swap(src);
     }
 
-    inline void CleanWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
-                             bool long_clean=true, uint8_t long_len=10, uint8_t min_changes=4)
+    // Distinct word growth measured on a sample of the corpus, used to reserve count maps up front.
+    // The vocabulary follows Heaps' law, distinct words grow with bytes^exponent.
+    struct VocabGrowth
     {
-        std::vector<std::u32string> repWords;
+        double sampleWords;
+        double sampleBytes;
+        double exponent;
 
-        for (const auto& n : words)
+        VocabGrowth() : sampleWords(0), sampleBytes(0), exponent(0) {};
+
+        double Predict(double bytes) const
         {
-            if (n.first.length() > MaxRepLen) {
+            if (sampleBytes <= 0) return 0;
+
+            return sampleWords * std::pow(bytes / sampleBytes, exponent);
+        }
+    };
+
+    // Reads about sample_bytes spread over the planned tasks and counts their distinct words with HyperLogLog.
+    // The exponent comes from comparing the first half of the sample with the whole sample.
+    inline VocabGrowth EstimateVocabGrowth(const std::vector<std::string>& files, const std::vector<FileTask>& tasks,
+                                           uint64_t sample_bytes, size_t range_size=1024*1024)
+    {
+        std::vector<FileRange> ranges;
+        VocabGrowth result;
+        HyperLogLog halfSketch, fullSketch;
+        double halfBytes = 0;
+        std::u32string rangeText;
+        MappedFile file;
+
+        for (const FileTask& task : tasks)
+            for (const FileRange& range : task.ranges) ranges.push_back(range);
+
+        // fixed seed so the same corpus always gets the same reservation
+        std::mt19937_64 rng(1);
+        std::shuffle(ranges.begin(), ranges.end(), rng);
+
+        for (const FileRange& range : ranges)
+        {
+            if (result.sampleBytes >= sample_bytes) break;
+
+            if (!file.Open(files[range.file]) || file.Size() < 2) continue;
+            if (!IsUTF8orASCII(std::string(file.Data(), 2)) || DetectCompression(file.Data(), file.Size()) != CompressNone) continue;
+
+            size_t rangeStart = NextWordBoundary(file.Data(), file.Size(), std::min<uint64_t>(range.begin, file.Size()));
+            size_t rangeEnd = NextWordBoundary(file.Data(), file.Size(), std::min<uint64_t>(std::min<uint64_t>(range.end, rangeStart + range_size), file.Size()));
+
+            if (rangeStart >= rangeEnd) continue;
+
+            try {
+                rangeText = cv_u8_u32.from_bytes(file.Data() + rangeStart, file.Data() + rangeEnd);
+            } catch (std::range_error&) {
+                continue;
+            }
+
+            bool firstHalf = (result.sampleBytes < sample_bytes / 2);
+            WordState wordState;
+
+            ForEachWord(rangeText.data(), rangeText.length(), wordState, [&](const std::u32string& word) {
+                uint64_t hash = std::hash<std::u32string>()(word);
+                fullSketch.Add(hash);
+                if (firstHalf) halfSketch.Add(hash);
+            });
+
+            result.sampleBytes += rangeEnd - rangeStart;
+            if (firstHalf) halfBytes = result.sampleBytes;
+        }
+
+        result.sampleWords = fullSketch.Estimate();
+
+        double halfWords = halfSketch.Estimate();
+
+        // typical text lies around 0.5 to 0.7, a small sample can't tell so the middle is used
+        result.exponent = 0.6;
+
+        if (halfBytes > 0 && result.sampleBytes > halfBytes * 1.5 && halfWords > 0 && result.sampleWords > halfWords)
+            result.exponent = std::clamp(std::log(result.sampleWords / halfWords) / std::log(result.sampleBytes / halfBytes), 0.3, 1.0);
+
+        return result;
+    }
+
+    // Counts are spread over GetThreadCount() threads. Large files are cut into ranges at word boundaries
+    // and small files are batched, so one huge file doesn't decide the total build time.
+    // Gzip and zstd files are found by their magic bytes and decompressed on a separate thread while counting.
+    // Each thread counts up to LocalCountWords distinct words on its own and then adds them to one shared map,
+    // so memory grows with the vocabulary and not with the number of threads.
+    // For large corpora the shared map is reserved from a sampled vocabulary estimate so it never rehashes.
+    inline void GenEnglishWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string data_dir, bool set_indices=true)
+    {
+        std::vector<std::string> files(ListFiles(data_dir));
+        size_t threadCount = GetThreadCount();
+        std::vector<FileTask> tasks(PlanFileTasks(files, threadCount, TaskSize,
+            [&files](size_t f) { return DetectFileCompression(files[f]) == CompressNone; }));
+        std::vector<CountMap> threadWords(threadCount);
+        SharedCountMap sharedWords;
+        std::mutex logMutex;
+        uint64_t totalBytes = 0;
+
+        for (const FileTask& task : tasks) totalBytes += task.bytes;
+
+        if (totalBytes >= PresizeMinBytes) {
+            VocabGrowth growth(EstimateVocabGrowth(files, tasks, std::clamp<uint64_t>(totalBytes / 100, 4*1024*1024, 64*1024*1024)));
+            size_t wordReserve = (size_t)growth.Predict(totalBytes);
+
+            std::cout << "Estimated Word Count: " << wordReserve << std::endl;
+
+            sharedWords.reserve(wordReserve);
+
+            for (CountMap& counts : threadWords) counts.reserve(std::min<size_t>(wordReserve, LocalCountWords));
+        }
+
+        AddBaseChars(words);
+
+        RunWorkStealing(tasks, threadCount, [&](const FileTask& task, size_t t) {
+            // std::wstring_convert keeps state so every worker thread needs its own
+            thread_local std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> converter;
+            FileRangeReader reader;
+            std::u32string rangeText;
+            std::string_view data;
+            CountMap& localWords = threadWords[t];
+
+            auto countWord = [&](const std::u32string& word) {
+                auto it = localWords.try_emplace(word, 0).first;
+                if (it->second < UINT32_MAX) it->second++;
+
+                if (localWords.size() >= LocalCountWords) FlushWordCounts(sharedWords, localWords);
+            };
+
+            for (const FileRange& range : task.ranges)
+            {
+                if (!reader.Load(files, range, data)) HandleFatalError("Couldn't read file: " + files[range.file]);
+
+                if (range.begin == 0) {
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    std::cout << "Reading file: " << files[range.file] << std::endl;
+                }
+
+                CompressionType compression = DetectCompression(data.data(), data.size());
+
+                if (compression != CompressNone) {
+
+                    if (!CanDecompress(compression)) {
+                        std::lock_guard<std::mutex> lock(logMutex);
+                        std::cout << "Skipping compressed file (no decompression support built in): " << files[range.file] << std::endl;
+                        continue;
+                    }
+
+                    DecompressReader stream(data);
+
+                    if (!ForEachWordInStream(stream, countWord)) {
+                        std::lock_guard<std::mutex> lock(logMutex);
+                        std::cout << "Couldn't decompress file: " << files[range.file] << std::endl;
+                    }
+
+                    continue;
+                }
+
+                if (!IsUTF8orASCII(std::string(data.substr(0, 2)))) continue;
+
+                // ranges of a split file meet at the same boundary, so no word is counted twice
+                size_t rangeStart = NextWordBoundary(data.data(), data.size(), std::min<uint64_t>(range.begin, data.size()));
+                size_t rangeEnd = NextWordBoundary(data.data(), data.size(), std::min<uint64_t>(range.end, data.size()));
+
+                if (rangeStart >= rangeEnd) continue;
+
+                try {
+                    rangeText = converter.from_bytes(data.data() + rangeStart, data.data() + rangeEnd);
+                } catch (std::range_error&) {
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    std::cout << "Skipping invalid UTF8 in file: " << files[range.file] << std::endl;
+                    continue;
+                }
+
+                WordState wordState;
+                ForEachWord(rangeText.data(), rangeText.length(), wordState, countWord);
+            }
+        });
+
+        for (CountMap& counts : threadWords)
+        {
+            FlushWordCounts(sharedWords, counts);
+            CountMap().swap(counts);
+        }
+
+        words.reserve(words.size() + sharedWords.size());
+
+        MergeWordCounts(words, sharedWords);
+
+        if (set_indices) SetMapIndices(words);
+
+        //for (const auto& n : words)
+            //std::cout << cv_u8_u32.to_bytes(n.first) << ": " << n.second << std::endl;
+
+        std::cout << "Final Word Count: " << words.size() << std::endl;
+    }
+
+    // Counts in how many files each word appears instead of how often. Compressed files are decompressed
+    // like in GenEnglishWordMap, files that aren't UTF8 are skipped.
+    inline void GenEnglishWordMapAlt(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string data_dir, bool set_indices=true)
+    {
+        std::u32string fileText;
+
+        phmap::parallel_flat_hash_map<std::u32string, bool> wordsAlt;
+
+        std::vector<std::string> files(ListFiles(data_dir));
+
+        AsyncFileReader fileReader(files, PrefetchFiles);
+
+        auto addWord = [&wordsAlt](const std::u32string& word) { wordsAlt.try_emplace(word, true); };
+
+        while (FileBuffer* fileBuf = fileReader.Next())
+        {
+            std::cout << "Reading file: " << fileBuf->path << std::endl;
+
+            if (!fileBuf->ok) HandleFatalError("Couldn't read file: " + fileBuf->path);
+
+            CompressionType compression = DetectCompression(fileBuf->data.data(), fileBuf->data.size());
+
+            wordsAlt.clear();
+
+            if (compression != CompressNone) {
+
+                if (!CanDecompress(compression)) {
+                    std::cout << "Skipping compressed file (no decompression support built in): " << fileBuf->path << std::endl;
+                    fileReader.Release(fileBuf);
+                    continue;
+                }
+
+                // the stream reads from the buffer, so it has to finish before the buffer is released
+                {
+                    DecompressReader stream(fileBuf->data);
+
+                    if (!ForEachWordInStream(stream, addWord))
+                        std::cout << "Couldn't decompress file: " << fileBuf->path << std::endl;
+                }
+
+                fileReader.Release(fileBuf);
+
+            } else {
+
+                if (!IsUTF8orASCII(fileBuf->data)) {
+                    fileReader.Release(fileBuf);
+                    continue;
+                }
+
+                try {
+                    fileText = cv_u8_u32.from_bytes(fileBuf->data.data());
+                } catch (std::range_error&) {
+                    std::cout << "Skipping invalid UTF8 in file: " << fileBuf->path << std::endl;
+                    fileReader.Release(fileBuf);
+                    continue;
+                }
+
+                fileReader.Release(fileBuf);
+
+                WordState wordState;
+                ForEachWord(fileText.data(), fileText.length(), wordState, addWord);
+            }
+
+            for (const auto& n : wordsAlt)
+            {
+                if (words.contains(n.first)) {
+                    if (words[n.first] < UINT32_MAX)
+                        words[n.first] += 1;
+                } else {
+                    words[n.first] = 1;
+                }
+            }
+
+            std::cout << "Word Count: " << words.size() << std::endl;
+        }
+
+        if (set_indices) SetMapIndices(words);
+
+        std::cout << "Final Word Count: " << words.size() << std::endl;
+    }
+
+    // chance that a word seen count times in a fraction of the corpus appears at least min_count times overall
+    inline double PassChance(uint64_t count, double fraction, uint32_t min_count)
+    {
+        double mean = fraction * min_count;
+
+        if (count >= min_count || fraction >= 1.0) return (count >= min_count) ? 1.0 : 0.0;
+
+        // P(Poisson(mean) <= count), the posterior of the true count with a flat prior
+        double term = std::exp(-mean);
+        double sum = term;
+
+        for (uint64_t i=1; i <= count; ++i)
+        {
+            term *= mean / i;
+            sum += term;
+        }
+
+        return std::min(sum, 1.0);
+    }
+
+    struct SampleEstimate
+    {
+        uint64_t totalBytes;
+        uint64_t sampledBytes;
+        size_t sampledRanges;
+        double estVocabSize;
+        phmap::parallel_flat_hash_map<std::u32string, float> passChance;
+
+        SampleEstimate() : totalBytes(0), sampledBytes(0), sampledRanges(0), estVocabSize(0) {};
+    };
+
+    // Counts words in a seeded random sample of byte ranges and scales the counts to the corpus size.
+    // Compressed files can't be read at random offsets, so a file picked for the sample is decompressed whole
+    // and the decompressed size of the others is scaled from the compression ratio of the sampled ones.
+    // With time_budget > 0 (seconds) more ranges are sampled until the budget runs out.
+    // estVocabSize sums the pass chances of sampled words, rare words the sample missed are not included.
+    inline SampleEstimate EstimateWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                                          std::string data_dir, double sample_rate=0.01, uint64_t seed=1,
+                                          double time_budget=0, size_t range_size=1024*1024, bool set_indices=true)
+    {
+        struct SampleRange
+        {
+            uint32_t file;
+            uint64_t offset;
+        };
+
+        SampleEstimate result;
+        std::vector<SampleRange> ranges;
+        std::vector<long long> fileSizes;
+        std::vector<char> isCompressed;
+        std::u32string rangeText;
+        MappedFile file;
+        uint32_t openFile = UINT32_MAX;
+        uint64_t plainBytes = 0;
+        uint64_t compressedBytes = 0;
+        uint64_t sampledCompressedBytes = 0;
+        uint64_t decompressedBytes = 0;
+        size_t sampledFiles = 0;
+        auto startTime = std::chrono::steady_clock::now();
+
+        // sorted so the same seed picks the same ranges whatever order the directory lists
+        std::vector<std::string> files(ListFiles(data_dir));
+        std::sort(files.begin(), files.end());
+
+        if (range_size == 0) range_size = 1;
+
+        for (uint32_t f=0; f < files.size(); ++f)
+        {
+            fileSizes.push_back(FileSize(files[f]));
+            isCompressed.push_back(false);
+            if (fileSizes[f] <= 0) continue;
+
+            if (!file.Open(files[f])) HandleFatalError("Couldn't open file: " + files[f]);
+            openFile = f;
+
+            CompressionType compression = DetectCompression(file.Data(), file.Size());
+
+            if (compression != CompressNone && !CanDecompress(compression)) {
+                std::cout << "Skipping compressed file (no decompression support built in): " << files[f] << std::endl;
+                fileSizes[f] = 0;
+                continue;
+            }
+
+            if (compression == CompressNone && file.Size() >= 2 && !IsUTF8orASCII(std::string(file.Data(), 2))) {
+                fileSizes[f] = 0;
+                continue;
+            }
+
+            // a compressed file gets as many chances to be picked as a plain file of its stored size
+            isCompressed[f] = (compression != CompressNone);
+            (isCompressed[f] ? compressedBytes : plainBytes) += fileSizes[f];
+
+            for (uint64_t offset=0; offset < (uint64_t)fileSizes[f]; offset += range_size)
+                ranges.push_back({f, offset});
+        }
+
+        std::mt19937_64 rng(seed);
+        std::shuffle(ranges.begin(), ranges.end(), rng);
+
+        size_t sampleCount = std::min(ranges.size(), (size_t)std::ceil(sample_rate * ranges.size()));
+
+        auto sampleCompressed = [&](uint32_t f) {
+            uint64_t fileBytes = 0;
+
+            DecompressReader stream(std::string_view(file.Data(), file.Size()));
+
+            if (!ForEachWordInStream(stream, [&words](const std::u32string& word) {
+                    auto it = words.try_emplace(word, 0).first;
+                    if (it->second < UINT32_MAX) it->second++;
+                }, &fileBytes)) {
+                std::cout << "Couldn't decompress file: " << files[f] << std::endl;
+            }
+
+            // a file without any text tells nothing about the ratio and holds nothing to count
+            if (fileBytes == 0) {
+                compressedBytes -= fileSizes[f];
+            } else {
+                sampledCompressedBytes += fileSizes[f];
+                decompressedBytes += fileBytes;
+                result.sampledBytes += fileBytes;
+            }
+
+            fileSizes[f] = 0;
+            sampledFiles++;
+        };
+
+        for (size_t r=0; r < ranges.size(); ++r)
+        {
+            if (r >= sampleCount) {
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+                if (time_budget <= 0 || elapsed >= time_budget) break;
+            }
+
+            const SampleRange& range = ranges[r];
+
+            // the other ranges of a compressed file that was already read whole
+            if (fileSizes[range.file] <= 0) continue;
+
+            if (range.file != openFile) {
+                if (!file.Open(files[range.file])) HandleFatalError("Couldn't open file: " + files[range.file]);
+                openFile = range.file;
+            }
+
+            if (isCompressed[range.file]) {
+                sampleCompressed(range.file);
+                continue;
+            }
+
+            // aligned ranges of neighbouring offsets meet exactly, so no word is counted twice
+            size_t rangeStart = NextWordBoundary(file.Data(), file.Size(), range.offset);
+            size_t rangeEnd = NextWordBoundary(file.Data(), file.Size(), std::min<uint64_t>(range.offset + range_size, file.Size()));
+
+            result.sampledRanges++;
+
+            if (rangeStart >= rangeEnd) continue;
+
+            result.sampledBytes += rangeEnd - rangeStart;
+
+            try {
+                rangeText = cv_u8_u32.from_bytes(file.Data() + rangeStart, file.Data() + rangeEnd);
+            } catch (std::range_error&) {
+                continue;
+            }
+
+            WordState wordState;
+            CountWords(rangeText.data(), rangeText.length(), words, wordState);
+        }
+
+        // without one decompressed file the ratio is unknown, so the first compressed file in the shuffled order is read
+        for (size_t r=0; r < ranges.size() && compressedBytes > 0 && sampledCompressedBytes == 0; ++r)
+        {
+            if (!isCompressed[ranges[r].file] || fileSizes[ranges[r].file] <= 0) continue;
+
+            if (!file.Open(files[ranges[r].file])) HandleFatalError("Couldn't open file: " + files[ranges[r].file]);
+            openFile = ranges[r].file;
+
+            sampleCompressed(ranges[r].file);
+        }
+
+        result.totalBytes = plainBytes;
+
+        if (sampledCompressedBytes > 0)
+            result.totalBytes += (uint64_t)std::round((double)compressedBytes * decompressedBytes / sampledCompressedBytes);
+
+        if (result.sampledBytes == 0)
+            std::cout << "Nothing could be sampled, the corpus has no readable text" << std::endl;
+
+        double fraction = (result.totalBytes > 0) ? std::min(1.0, (double)result.sampledBytes / result.totalBytes) : 1.0;
+
+        for (auto& n : words)
+        {
+            double chance = PassChance(n.second, fraction, MinOccurr);
+
+            result.passChance[n.first] = chance;
+            result.estVocabSize += chance;
+
+            n.second = (uint32_t)std::min<double>(std::round(n.second / fraction), UINT32_MAX);
+        }
+
+        // base characters are always kept, same as GenEnglishWordMap seeding them with MinOccurr
+        for (char32_t i=32; i < 127; ++i)
+        {
+            auto it = words.try_emplace(std::u32string(1, i), 0).first;
+            it->second = (uint32_t)std::min<uint64_t>((uint64_t)it->second + MinOccurr, UINT32_MAX);
+
+            float& chance = result.passChance[it->first];
+            result.estVocabSize += 1.0 - chance;
+            chance = 1.0;
+        }
+
+        std::cout << "Sampled " << result.sampledRanges << " ranges and " << sampledFiles << " compressed files (" << (fraction * 100) << "% of corpus)" << std::endl;
+        std::cout << "Estimated Word Count: " << (size_t)std::round(result.estVocabSize) << std::endl;
+
+        if (set_indices) SetMapIndices(words);
+
+        return result;
+    }
+
+    inline void SaveWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string map_file)
+    {
+        std::string wordStr, tempStr;
+        std::vector<std::u32string> wordVec;
+        wordVec.resize(words.size());
+
+        for (const auto& n : words) wordVec[n.second] = n.first;
+
+        FILE* pFile = fopen(map_file.c_str(), "wb");
+        if (pFile == NULL) HandleFatalError("Failed to create "+map_file);
+
+        for (const std::u32string& word : wordVec)
+        {
+            try {
+                tempStr.assign(cv_u8_u32.to_bytes(word));
+                wordStr.assign(1, tempStr.length());
+                wordStr += tempStr;
+                fwrite(wordStr.data(), 1, wordStr.size(), pFile);
+
+            } catch (std::range_error& exception) {
+
+                std::cout << "Corrupt word detected. Contains characters: " << word.length() << std::endl;
+
+                for (const auto& c : word) std::cout << "Char code: " << c << std::endl;
+
+                std::string userIn;
+                std::cout << "Skip word and continue saving word map? (type Y for yes) ";
+                std::cin >> userIn;
+
+                if (StrToUpper(userIn) != "Y") exit(EXIT_FAILURE);
+            }
+        }
+
+        fclose(pFile);
+
+        std::cout << "Saved word map to " << map_file << std::endl;
+    }
+
+    inline void LoadWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, std::string map_file)
+    {
+        WordMapVersion++;
+
+        std::u32string word;
+        std::string wordStr;
+        uint32_t wordIndex = 0;
+        uint8_t wordSize = 0;
+
+        words.clear();
+
+        FILE* pFile = fopen(map_file.c_str(), "rb");
+        if (pFile == NULL) HandleFatalError("Failed to open "+map_file);
+
+        while (fread(&wordSize, 1, 1, pFile))
+        {
+            wordStr.resize(wordSize);
+
+            if (fread(wordStr.data(), 1, wordSize, pFile)) {
+                word = cv_u8_u32.from_bytes(wordStr.data());
+                words[word] = wordIndex++;
+            } else {
+                HandleFatalError("Corrupt wordmap file detected");
+            }
+        }
+
+        fclose(pFile);
+
+        std::cout << "Loaded word map with " << words.size() << " tokens" << std::endl;
+    }
+
+    inline void DelWordsFromMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                              std::vector<std::u32string> del_words)
+    {
+        WordMapVersion++;
+
+        bool foundWord = false;
+        uint32_t wordIndex = 0;
+
+        for (auto it = words.begin(); it != words.end();)
+        {
+            for (const auto& word : del_words)
+            {
+                if (it->first == word) {
+                    it = words.erase(it);
+                    foundWord = true;
+                    break;
+                }
+            }
+
+            if (foundWord) {
+                foundWord = false;
+            } else {
+                it++;
+            }
+        }
+
+        for (auto& n : words) n.second = wordIndex++;
+
+        CompactIfSparse(words);
+    }
+
+    inline void AddWordsToMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                              std::vector<std::u32string> new_words)
+    {
+        WordMapVersion++;
+
+        uint32_t wordIndex = words.size();
+
+        if (wordIndex + new_words.size() > UINT32_MAX)
+            HandleFatalError("Size of merged map cannot exceed UINT32_MAX");
+
+        for (const auto& word : new_words)
+        {
+            if (words.contains(word)) continue;
+
+            words[word] = wordIndex++;
+
+            std::cout << "Added " << U32ToU8(word) << " to word map" << std::endl;
+        }
+
+        std::cout << "Final word count " << words.size() << std::endl;
+    }
+
+    inline void CleanWordMap(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                             bool long_clean=true, uint8_t long_len=10, uint8_t min_changes=4)
+    {
+        std::vector<std::u32string> repWords;
+
+        for (const auto& n : words)
+        {
+            if (n.first.length() > MaxRepLen) {
 
                 bool isRepWord = true;
                 uint32_t firstChar = n.first[0];
@@ -460,59 +1296,452 @@ namespace Worderizer {
                     }
                 }
 
-                if (isRepWord) repWords.push_back(n.first);
+                if (isRepWord) repWords.push_back(n.first);
+            }
+        }
+
+        DelWordsFromMap(words, repWords);
+
+        std::cout << "Removed " << repWords.size() << " same-character words" << std::endl;
+
+        if (!long_clean) return;
+
+        repWords.clear();
+
+        for (const auto& n : words)
+        {
+            if (n.first.length() >= long_len) {
+
+                uint32_t changes = 0;
+                uint32_t lastChar = n.first[0];
+
+                for (size_t c=1; c < n.first.length(); ++c)
+                {
+                    if (lastChar != n.first[c]) {
+                        lastChar = n.first[c];
+                        changes++;
+                    }
+                }
+
+                if (changes < min_changes) repWords.push_back(n.first);
+            }
+        }
+
+        DelWordsFromMap(words, repWords);
+
+        std::cout << "Removed " << repWords.size() << " long repetitive words" << std::endl;
+    }
+
+    inline void MergeWordMaps(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& dest_words,
+                       const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& more_words)
+    {
+        WordMapVersion++;
+
+        uint32_t wordIndex = dest_words.size();
+
+        if (wordIndex + more_words.size() > UINT32_MAX)
+            HandleFatalError("Size of merged map cannot exceed UINT32_MAX");
+
+        for (const auto& n : more_words) {
+            if (!dest_words.contains(n.first))
+                dest_words[n.first] = wordIndex++;
+        }
+    }
+
+    inline std::vector<uint64_t> CountWordsInFiles(const std::vector<std::u32string>& find_words,
+                                                   const std::vector<std::string>& files)
+    {
+        std::vector<std::string> patterns;
+        std::vector<uint64_t> counts;
+
+        patterns.reserve(find_words.size());
+
+        for (const auto& word : find_words) patterns.emplace_back(U32ToU8(word));
+
+        AhoCorasick automaton(patterns);
+        CountPatternsInFiles(automaton, files, counts, GetThreadCount(), TaskSize);
+
+        return counts;
+    }
+
+    inline std::vector<std::u32string> SelectSpecialPairs(const std::vector<std::u32string>& candidates,
+                                                          std::string data_dir, uint64_t min_count=0)
+    {
+        std::vector<std::u32string> result;
+
+        if (min_count == 0) min_count = MinOccurr;
+
+        std::vector<uint64_t> counts(CountWordsInFiles(candidates, ListFiles(data_dir)));
+
+        for (size_t i=0; i < candidates.size(); ++i)
+        {
+            if (counts[i] >= min_count) result.push_back(candidates[i]);
+
+            std::cout << "Pair " << U32ToU8(candidates[i]) << " found " << counts[i] << " times" << std::endl;
+        }
+
+        return result;
+    }
+
+    inline bool FindToken(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                          const std::u32string& word, uint32_t& token)
+    {
+        auto it = words.find(word);
+        if (it == words.end()) return false;
+
+        token = it->second;
+        return true;
+    }
+
+    // Dense tables for the most frequent lookups: single characters below 256, any two ASCII characters
+    // (special pairs and short words) and ASCII numbers of 3 or 4 digits. They let the tokenizer skip hashing
+    // for these words, build them once the word map no longer changes.
+    class FastTokenTables
+    {
+    public:
+        enum FindResult { NotCovered, NotFound, Found };
+
+        static constexpr uint32_t NoToken = UINT32_MAX;
+
+        FastTokenTables() {};
+
+        explicit FastTokenTables(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+        {
+            Build(words);
+        }
+
+        void Build(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+        {
+            std::u32string word;
+
+            singleTokens.assign(256, NoToken);
+            pairTokens.assign(128 * 128, NoToken);
+            numberTokens.assign(1000 + 10000, NoToken);
+
+            // probing every covered word costs the same whatever the size of the word map
+            for (char32_t c=0; c < 256; ++c)
+                Probe(words, word.assign(1, c), singleTokens[c]);
+
+            for (char32_t a=0; a < 128; ++a)
+                for (char32_t b=0; b < 128; ++b)
+                    Probe(words, word.assign({a, b}), pairTokens[a * 128 + b]);
+
+            for (uint32_t n=0; n < 1000; ++n)
+                Probe(words, word.assign({char32_t('0' + n/100), char32_t('0' + n/10%10), char32_t('0' + n%10)}), numberTokens[n]);
+
+            for (uint32_t n=0; n < 10000; ++n)
+                Probe(words, word.assign({char32_t('0' + n/1000), char32_t('0' + n/100%10), char32_t('0' + n/10%10), char32_t('0' + n%10)}), numberTokens[1000 + n]);
+        }
+
+        FindResult Find(const std::u32string& word, uint32_t& token) const
+        {
+            if (!Built()) return NotCovered;
+
+            const size_t length = word.length();
+
+            if (length == 1) {
+                if (word[0] >= 256) return NotCovered;
+                token = singleTokens[word[0]];
+            } else if (length == 2) {
+                if ((word[0] | word[1]) >= 128) return NotCovered;
+                token = pairTokens[word[0] * 128 + word[1]];
+            } else if (length == 3 || length == 4) {
+                uint32_t value = 0;
+
+                for (const char32_t& c : word)
+                {
+                    if (!IsDigit(c)) return NotCovered;
+                    value = value * 10 + (c - '0');
+                }
+
+                token = numberTokens[(length == 4) ? 1000 + value : value];
+            } else {
+                return NotCovered;
+            }
+
+            return (token == NoToken) ? NotFound : Found;
+        }
+
+        bool Built() const { return !singleTokens.empty(); }
+
+        size_t MemoryBytes() const
+        {
+            return (singleTokens.capacity() + pairTokens.capacity() + numberTokens.capacity()) * sizeof(uint32_t);
+        }
+
+    private:
+        std::vector<uint32_t> singleTokens;
+        std::vector<uint32_t> pairTokens;
+        std::vector<uint32_t> numberTokens;
+
+        static void Probe(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                          const std::u32string& word, uint32_t& dest)
+        {
+            auto it = words.find(word);
+            dest = (it == words.end()) ? NoToken : it->second;
+        }
+    };
+
+    // looks in the dense tables first and only hashes words they don't cover
+    inline bool FindToken(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                          const FastTokenTables* fast, const std::u32string& word, uint32_t& token)
+    {
+        if (fast != nullptr) {
+            FastTokenTables::FindResult result = fast->Find(word, token);
+            if (result != FastTokenTables::NotCovered) return result == FastTokenTables::Found;
+        }
+
+        return FindToken(words, word, token);
+    }
+
+    // A skipped char only ends the current word, and each one resolves at least one char of a word left
+    // unfinished before it. So after more than MaxWordLen skipped chars in a row the word state is reset
+    // and nothing before the run can reach past it.
+    inline size_t SkipRunLength() { return (size_t)MaxWordLen + 1; }
+
+    // checks if tokenizing norm_str before and after pos separately gives the same tokens as one pass
+    inline bool IsSafeSplit(const std::u32string& norm_str, size_t pos,
+                            const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    {
+        if (pos == 0 || pos >= norm_str.length()) return true;
+
+        const char32_t lastChar = norm_str[pos-1];
+
+        if (SkipChar(lastChar)) {
+            for (size_t i=1; i <= SkipRunLength() && i <= pos; ++i)
+                if (!SkipChar(norm_str[pos-i])) return false;
+            return true;
+        }
+
+        // a separator always starts as a fresh single character word, so only a special pair can cross pos
+        if (IsAlpha(lastChar) || IsDigit(lastChar)) return false;
+
+        char32_t pair[2] = { lastChar, norm_str[pos] };
+
+        return !words.contains(std::u32string(pair, 2));
+    }
+
+    // decodes the UTF8 char starting at data[pos], returns its length or 0 if it is cut off
+    inline size_t DecodeUTF8Char(const char* data, size_t size, size_t pos, char32_t& c)
+    {
+        const uint8_t leadByte = data[pos];
+        size_t charLen = (leadByte < 0x80) ? 1 : (leadByte >> 5) == 0x6 ? 2 : (leadByte >> 4) == 0xE ? 3 : 4;
+
+        if (pos + charLen > size) return 0;
+
+        c = (charLen == 1) ? leadByte : (charLen == 2) ? (leadByte & 0x1F) :
+            (charLen == 3) ? (leadByte & 0x0F) : (leadByte & 0x07);
+
+        for (size_t i=1; i < charLen; ++i) c = (c << 6) | (data[pos+i] & 0x3F);
+
+        return charLen;
+    }
+
+    // start of the UTF8 char that ends right before data[pos]
+    inline size_t PrevUTF8Char(const char* data, size_t pos)
+    {
+        size_t start = pos - 1;
+
+        while (start > 0 && pos - start < 4 && ((uint8_t)data[start] & 0xC0) == 0x80) start--;
+
+        return start;
+    }
+
+    // same as IsSafeSplit but works on raw UTF8 text before normalization, data[pos] must be a char boundary
+    inline bool IsSafeByteSplit(const char* data, size_t size, size_t pos,
+                                const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    {
+        if (pos == 0 || pos >= size) return true;
+
+        char32_t lastChar = 0;
+        char32_t nextChar = 0;
+        size_t lastPos = PrevUTF8Char(data, pos);
+
+        // substituted chars may expand to several chars, so they are never split after
+        if (DecodeUTF8Char(data, size, lastPos, lastChar) != pos - lastPos || IsInSubTable(lastChar)) return false;
+
+        if (SkipChar(lastChar)) {
+            for (size_t i=1; i < SkipRunLength(); ++i)
+            {
+                if (lastPos == 0) return true;
+
+                lastPos = PrevUTF8Char(data, lastPos);
+
+                if (DecodeUTF8Char(data, size, lastPos, lastChar) == 0 || IsInSubTable(lastChar) || !SkipChar(lastChar))
+                    return false;
+            }
+
+            return true;
+        }
+
+        if (IsAlpha(lastChar) || IsDigit(lastChar)) return false;
+
+        if (DecodeUTF8Char(data, size, pos, nextChar) == 0) return false;
+
+        if (IsInSubTable(nextChar)) {
+            if (charSubTable[nextChar].sub.empty()) return false;
+            nextChar = charSubTable[nextChar].sub[0];
+        }
+
+        char32_t pair[2] = { lastChar, nextChar };
+
+        return !words.contains(std::u32string(pair, 2));
+    }
+
+    // first char boundary at or after pos where IsSafeByteSplit holds
+    inline size_t NextSafeByteSplit(const char* data, size_t size, size_t pos,
+                                    const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    {
+        while (pos < size && (((uint8_t)data[pos] & 0xC0) == 0x80 || !IsSafeByteSplit(data, size, pos, words))) pos++;
+
+        return std::min(pos, size);
+    }
+
+    // tokens for one whole word, including every piece produced by the fallback split
+    inline void SplitWordTokens(std::u32string word, const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                                std::vector<uint32_t>& tokens, size_t& unknown_at)
+    {
+        std::u32string nextWord;
+        bool foundToken = true;
+        uint32_t token = 0;
+
+        unknown_at = SIZE_MAX;
+
+        while (word.length() > 0)
+        {
+            foundToken = true;
+
+            while (!FindToken(words, word, token))
+            {
+                nextWord.push_back(word.back());
+                word.pop_back();
+
+                if (word.length() == 0) {
+                    foundToken = false;
+                    break;
+                }
+            }
+
+            if (foundToken) {
+                tokens.push_back(token);
+            } else if (unknown_at == SIZE_MAX) {
+                unknown_at = tokens.size();
+            }
+
+            if (nextWord.length() > 1) {
+                word.assign(nextWord.begin(), nextWord.end()-(!foundToken));
+                std::reverse(word.begin(), word.end());
+            } else if (foundToken) {
+                word = nextWord;
+            } else {
+                word.clear();
+            }
+
+            nextWord.clear();
+        }
+    }
+
+    // Direct-mapped cache from a word to the tokens it produced, so repeated words skip the fallback split.
+    // Not thread safe, give each thread its own cache (see GetThreadWordCache).
+    class WordCache
+    {
+    public:
+        struct Entry
+        {
+            std::u32string word;
+            std::vector<uint32_t> tokens;
+            size_t unknownAt;
+            bool used;
+
+            Entry() : unknownAt(SIZE_MAX), used(false) {};
+        };
+
+        WordCache(size_t slot_count=4096) : cacheHits(0), cacheMisses(0), wordMap(nullptr), mapVersion(0)
+        {
+            size_t slots = 1;
+            while (slots < slot_count) slots <<= 1;
+
+            cacheSlots.resize(slots);
+            slotMask = slots - 1;
+        }
+
+        // the returned entry stays valid until the next call
+        const Entry& Get(const std::u32string& word, const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+        {
+            if (&words != wordMap || WordMapVersion != mapVersion) {
+                Clear();
+                wordMap = &words;
+                mapVersion = WordMapVersion;
             }
-        }
 
-        DelWordsFromMap(words, repWords);
+            Entry& entry = cacheSlots[std::hash<std::u32string>()(word) & slotMask];
 
-        std::cout << "Removed " << repWords.size() << " same-character words" << std::endl;
+            if (entry.used && entry.word == word) {
+                cacheHits++;
+                return entry;
+            }
 
-        if (!long_clean) return;
+            cacheMisses++;
+            entry.word = word;
+            entry.tokens.clear();
+            entry.used = true;
+            SplitWordTokens(word, words, entry.tokens, entry.unknownAt);
 
-        repWords.clear();
+            return entry;
+        }
 
-        for (const auto& n : words)
+        void Clear()
         {
-            if (n.first.length() >= long_len) {
-
-                uint32_t changes = 0;
-                uint32_t lastChar = n.first[0];
+            for (Entry& entry : cacheSlots) entry.used = false;
+        }
 
-                for (size_t c=1; c < n.first.length(); ++c)
-                {
-                    if (lastChar != n.first[c]) {
-                        lastChar = n.first[c];
-                        changes++;
-                    }
-                }
+        uint64_t Hits() const { return cacheHits; }
+        uint64_t Misses() const { return cacheMisses; }
 
-                if (changes < min_changes) repWords.push_back(n.first);
-            }
+        void ResetCounters()
+        {
+            cacheHits = 0;
+            cacheMisses = 0;
         }
 
-        DelWordsFromMap(words, repWords);
+    private:
+        std::vector<Entry> cacheSlots;
+        size_t slotMask;
+        uint64_t cacheHits;
+        uint64_t cacheMisses;
+        const void* wordMap;
+        uint64_t mapVersion;
+    };
 
-        std::cout << "Removed " << repWords.size() << " long repetitive words" << std::endl;
+    inline WordCache& GetThreadWordCache()
+    {
+        thread_local WordCache cache;
+        return cache;
     }
 
-    inline void MergeWordMaps(phmap::parallel_flat_hash_map<std::u32string, uint32_t>& dest_words,
-                       const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& more_words)
+    // dense tables of the calling thread, rebuilt like the word cache when another or a changed word map is passed
+    inline const FastTokenTables& GetThreadFastTables(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
     {
-        uint32_t wordIndex = dest_words.size();
-
-        if (wordIndex + more_words.size() > UINT32_MAX)
-            HandleFatalError("Size of merged map cannot exceed UINT32_MAX");
-
-        for (const auto& n : more_words) {
-            if (!dest_words.contains(n.first))
-                dest_words[n.first] = wordIndex++;
+        thread_local FastTokenTables tables;
+        thread_local const void* wordMap = nullptr;
+        thread_local uint64_t mapVersion = 0;
+
+        if (&words != wordMap || WordMapVersion != mapVersion || !tables.Built()) {
+            tables.Build(words);
+            wordMap = &words;
+            mapVersion = WordMapVersion;
         }
+
+        return tables;
     }
 
-    inline bool StrToTokens(const std::u32string& str, std::vector<uint32_t>& dest,
-                     phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
-                     bool skip_unknowns=true)
+    // tokenizes norm_str[begin,end) which must already be normalized, emit receives each token
+    // returns false if emit returns false or an unknown word is found when skip_unknowns is false
+    // fast is optional, it must have been built from words
+    template <typename Emit>
+    inline bool ScanTokens(const std::u32string& norm_str, size_t begin, size_t end,
+                           const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                           bool skip_unknowns, WordCache* cache, const FastTokenTables* fast, Emit&& emit)
     {
         std::u32string word, nextWord, tempStr;
         bool foundToken = false;
@@ -520,14 +1749,11 @@ namespace Worderizer {
         bool nextChar = false;
         bool isFirstChar = true;
         char32_t tempChar = 0;
+        uint32_t token = 0;
 
-        if (str.empty()) return false;
-
-        std::u32string normStr(NormalizeChars(str));
-
-        for (size_t c=0; c < normStr.length(); ++c)
+        for (size_t c=begin; c < end; ++c)
         {
-            tempChar = normStr[c];
+            tempChar = norm_str[c];
 
             while(true)
             {
@@ -536,19 +1762,42 @@ namespace Worderizer {
                     isFirstChar = true;
                     foundToken = true;
 
-                    if (!nextChar && word.length() == 1 && c < normStr.length()-1) {
+                    // short numbers and single letters found in the dense tables don't need the cache
+                    if (fast != nullptr && nextChar && fast->Find(word, token) == FastTokenTables::Found) {
+                        if (!emit(token)) return false;
+                        nextChar = false;
+                        continue;
+                    }
+
+                    // a word ended by the next character always splits the same way, so it can be cached
+                    if (cache != nullptr && nextChar) {
+
+                        const WordCache::Entry& entry = cache->Get(word, words);
+                        const bool stopAtUnknown = (!skip_unknowns && entry.unknownAt != SIZE_MAX);
+                        const size_t emitCount = stopAtUnknown ? entry.unknownAt : entry.tokens.size();
+
+                        for (size_t i=0; i < emitCount; ++i)
+                            if (!emit(entry.tokens[i])) return false;
+
+                        if (stopAtUnknown) return false;
+
+                        nextChar = false;
+                        continue;
+                    }
+
+                    if (!nextChar && word.length() == 1 && c < end-1) {
 
                         tempStr = word;
-                        tempStr.push_back(normStr[c+1]);
+                        tempStr.push_back(norm_str[c+1]);
 
-                        if (words.contains(tempStr)) {
-                            dest.push_back(words[tempStr]);
+                        if (FindToken(words, fast, tempStr, token)) {
+                            if (!emit(token)) return false;
                             c++;
                             break;
                         }
                     }
 
-                    while (!words.contains(word))
+                    while (!FindToken(words, fast, word, token))
                     {
                         nextWord.push_back(word.back());
                         word.pop_back();
@@ -560,7 +1809,7 @@ namespace Worderizer {
                     }
 
                     if (foundToken) {
-                        dest.push_back(words[word]);
+                        if (!emit(token)) return false;
                     } else if (!skip_unknowns) {
                         return false;
                     }
@@ -589,9 +1838,380 @@ namespace Worderizer {
             }
         }
 
+        return true;
+    }
+
+    inline bool StrToTokens(const std::u32string& str, std::vector<uint32_t>& dest,
+                     const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                     bool skip_unknowns=true, WordCache* cache=nullptr, const FastTokenTables* fast=nullptr)
+    {
+        if (str.empty()) return false;
+
+        // most text has nothing to substitute, so skip copying it
+        std::u32string normStr;
+        const bool normalize = NeedsNormalize(str);
+        if (normalize) normStr = NormalizeChars(str);
+        const std::u32string& text = normalize ? normStr : str;
+
+        bool success = ScanTokens(text, 0, text.length(), words, skip_unknowns, cache, fast,
+            [&dest](uint32_t token) { dest.push_back(token); return true; }
+        );
+
+        if (!success) return false;
+
+        return !dest.empty();
+    }
+
+    // number of tokens StrToTokens would add without storing them, unknown words are skipped
+    // with limit > 0 counting stops early and limit+1 is returned once the count exceeds it
+    // without a cache or tables the thread's word cache and dense tables are used, the tables are built on the first
+    // call for a word map, so it is about a third cheaper than StrToTokens without tables
+    inline size_t CountTokens(const std::u32string& str,
+                     const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                     size_t limit=0, WordCache* cache=nullptr, const FastTokenTables* fast=nullptr)
+    {
+        size_t tokenCount = 0;
+
+        if (str.empty()) return 0;
+
+        if (cache == nullptr) cache = &GetThreadWordCache();
+        if (fast == nullptr) fast = &GetThreadFastTables(words);
+
+        std::u32string normStr;
+        const bool normalize = NeedsNormalize(str);
+        if (normalize) normStr = NormalizeChars(str);
+        const std::u32string& text = normalize ? normStr : str;
+
+        ScanTokens(text, 0, text.length(), words, true, cache, fast,
+            [&tokenCount, limit](uint32_t) { return ++tokenCount <= limit || limit == 0; }
+        );
+
+        return tokenCount;
+    }
+
+    inline void CountTokens(const std::vector<std::u32string>& strs, std::vector<size_t>& counts,
+                     const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words, size_t limit=0)
+    {
+        size_t threadCount = std::min<size_t>(GetThreadCount(), strs.size());
+        std::vector<std::thread> threads;
+        std::atomic<size_t> nextStr(0);
+
+        counts.resize(strs.size());
+
+        if (threadCount < 2) {
+            for (size_t i=0; i < strs.size(); ++i)
+                counts[i] = CountTokens(strs[i], words, limit);
+            return;
+        }
+
+        // the threads are new, so one set of tables is shared instead of each building its own
+        FastTokenTables fastTables(words);
+
+        for (size_t t=0; t < threadCount; ++t)
+        {
+            threads.emplace_back([&] {
+                for (size_t i = nextStr++; i < strs.size(); i = nextStr++)
+                    counts[i] = CountTokens(strs[i], words, limit, nullptr, &fastTables);
+            });
+        }
+
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    // Same result as StrToTokens but a large input is cut at safe split points and tokenized on several threads.
+    // Inputs shorter than two segments of min_segment characters are tokenized on the calling thread.
+    inline bool StrToTokensParallel(const std::u32string& str, std::vector<uint32_t>& dest,
+                     const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                     bool skip_unknowns=true, size_t min_segment=1024*1024, const FastTokenTables* fast=nullptr)
+    {
+        size_t threadCount = std::min<size_t>(GetThreadCount(), str.length() / std::max<size_t>(min_segment, 1));
+
+        if (threadCount < 2) return StrToTokens(str, dest, words, skip_unknowns, nullptr, fast);
+
+        std::vector<std::u32string> normParts(threadCount);
+        std::vector<std::vector<uint32_t>> segTokens(threadCount);
+        std::vector<size_t> segBounds(threadCount+1, 0);
+        std::vector<char> segSuccess(threadCount, true);
+        std::vector<std::thread> threads;
+        std::u32string normStr;
+
+        // normalization maps each character on its own so the input can be split anywhere
+        for (size_t t=0; t < threadCount; ++t)
+        {
+            threads.emplace_back([&, t] {
+                size_t first = str.length() * t / threadCount;
+                size_t last = str.length() * (t+1) / threadCount;
+                normParts[t] = NormalizeChars(str.substr(first, last - first));
+            });
+        }
+
+        for (std::thread& thread : threads) thread.join();
+        threads.clear();
+
+        for (const std::u32string& part : normParts) normStr += part;
+        normParts.clear();
+
+        segBounds[threadCount] = normStr.length();
+
+        for (size_t t=1; t < threadCount; ++t)
+        {
+            size_t splitPos = std::max(normStr.length() * t / threadCount, segBounds[t-1]);
+
+            while (splitPos < normStr.length() && !IsSafeSplit(normStr, splitPos, words)) splitPos++;
+
+            segBounds[t] = splitPos;
+        }
+
+        for (size_t t=0; t < threadCount; ++t)
+        {
+            threads.emplace_back([&, t] {
+                std::vector<uint32_t>& tokens = segTokens[t];
+                tokens.reserve((segBounds[t+1] - segBounds[t]) / 4);
+
+                segSuccess[t] = ScanTokens(normStr, segBounds[t], segBounds[t+1], words, skip_unknowns,
+                    &GetThreadWordCache(), fast, [&tokens](uint32_t token) { tokens.push_back(token); return true; }
+                );
+            });
+        }
+
+        for (std::thread& thread : threads) thread.join();
+
+        size_t tokenCount = dest.size();
+        for (const std::vector<uint32_t>& tokens : segTokens) tokenCount += tokens.size();
+        dest.reserve(tokenCount);
+
+        // a failed segment stopped at its first unknown word, exactly where a single pass would stop
+        for (size_t t=0; t < threadCount; ++t)
+        {
+            dest.insert(dest.end(), segTokens[t].begin(), segTokens[t].end());
+            if (!segSuccess[t]) return false;
+        }
+
         return !dest.empty();
     }
 
+    // Packs the tokens of many documents straight into fixed-length sequences in a caller buffer.
+    // sep_token is written after every document, tokens that don't fit continue in the next sequence.
+    // The optional mask gets the document number inside the sequence for each token (1, 2, ...) and 0 for
+    // padding, so attention can be limited to tokens with the same number. Tokens past the end of the
+    // buffer are kept and written first into the next buffer given to SetBuffer().
+    class SequencePacker
+    {
+    public:
+        SequencePacker(size_t seq_len, uint32_t sep_token, uint32_t pad_token)
+            : seqLen(std::max<size_t>(seq_len, 1)), sepToken(sep_token), padToken(pad_token),
+              seqTokens(nullptr), seqMask(nullptr), writePos(0), bufferSize(0), docNumber(0), newDoc(false) {};
+
+        // tokens must hold seq_count * seq_len values, mask is either the same size or nullptr
+        void SetBuffer(uint32_t* tokens, uint32_t* mask, size_t seq_count)
+        {
+            seqTokens = tokens;
+            seqMask = mask;
+            writePos = 0;
+            bufferSize = seq_count * seqLen;
+
+            size_t carried = 0;
+
+            while (carried < carryTokens.size() && writePos < bufferSize)
+            {
+                newDoc = carryDocStarts[carried];
+                Push(carryTokens[carried++]);
+            }
+
+            carryTokens.erase(carryTokens.begin(), carryTokens.begin() + carried);
+            carryDocStarts.erase(carryDocStarts.begin(), carryDocStarts.begin() + carried);
+        }
+
+        // returns false once the buffer is full, documents added after that are carried over
+        bool AddDocument(const std::u32string& doc, const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                         WordCache* cache=nullptr, const FastTokenTables* fast=nullptr)
+        {
+            if (doc.empty()) return !Full();
+
+            std::u32string normStr;
+            const bool normalize = NeedsNormalize(doc);
+            if (normalize) normStr = NormalizeChars(doc);
+            const std::u32string& text = normalize ? normStr : doc;
+
+            size_t startPos = writePos;
+            size_t startCarry = carryTokens.size();
+
+            newDoc = true;
+
+            ScanTokens(text, 0, text.length(), words, true, cache, fast,
+                [this](uint32_t token) { Push(token); return true; }
+            );
+
+            // documents without any known token don't get a separator
+            if (writePos != startPos || carryTokens.size() != startCarry) Push(sepToken);
+
+            newDoc = false;
+
+            return !Full();
+        }
+
+        // pads the last sequence and returns the number of sequences written to the buffer
+        size_t Flush()
+        {
+            size_t seqEnd = (writePos + seqLen - 1) / seqLen * seqLen;
+
+            for (; writePos < seqEnd; ++writePos)
+            {
+                seqTokens[writePos] = padToken;
+                if (seqMask != nullptr) seqMask[writePos] = 0;
+            }
+
+            return writePos / seqLen;
+        }
+
+        bool Full() const { return writePos == bufferSize; }
+        size_t FullSequences() const { return writePos / seqLen; }
+        size_t CarriedTokens() const { return carryTokens.size(); }
+
+    private:
+        size_t seqLen;
+        uint32_t sepToken;
+        uint32_t padToken;
+        uint32_t* seqTokens;
+        uint32_t* seqMask;
+        size_t writePos;
+        size_t bufferSize;
+        uint32_t docNumber;
+        bool newDoc;
+        std::vector<uint32_t> carryTokens;
+        std::vector<char> carryDocStarts;
+
+        void Push(uint32_t token)
+        {
+            if (writePos == bufferSize) {
+                carryTokens.push_back(token);
+                carryDocStarts.push_back(newDoc);
+                newDoc = false;
+                return;
+            }
+
+            if (writePos % seqLen == 0) {
+                docNumber = 1;
+            } else if (newDoc) {
+                docNumber++;
+            }
+
+            newDoc = false;
+            seqTokens[writePos] = token;
+            if (seqMask != nullptr) seqMask[writePos] = docNumber;
+            writePos++;
+        }
+    };
+
+    // Tokenizes each file into the matching output file as uint32 tokens, files that aren't UTF8 or are compressed are skipped.
+    // Work is scheduled like GenEnglishWordMap, large files are cut at safe splits so the output of
+    // each file is the same as tokenizing it in one pass.
+    inline void TokenizeFiles(const std::vector<std::string>& files, const std::vector<std::string>& out_files,
+                              const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
+    {
+        struct FileOutput
+        {
+            std::mutex lock;
+            std::map<uint64_t, std::vector<uint32_t>> parts;
+            size_t pendingRanges = 0;
+            const char* skipReason = nullptr;
+        };
+
+        size_t threadCount = GetThreadCount();
+        std::vector<FileTask> tasks(PlanFileTasks(files, threadCount, TaskSize,
+            [&files](size_t f) { return DetectFileCompression(files[f]) == CompressNone; }));
+        std::vector<FileOutput> outputs(files.size());
+        FastTokenTables fastTables(words);
+        std::mutex logMutex;
+
+        if (out_files.size() != files.size()) HandleFatalError("Need one output file per input file");
+
+        for (const FileTask& task : tasks)
+            for (const FileRange& range : task.ranges) outputs[range.file].pendingRanges++;
+
+        RunWorkStealing(tasks, threadCount, [&](const FileTask& task, size_t) {
+            thread_local std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> converter;
+            FileRangeReader reader;
+            std::u32string rangeText;
+            std::vector<uint32_t> tokens;
+            std::string_view data;
+
+            for (const FileRange& range : task.ranges)
+            {
+                FileOutput& output = outputs[range.file];
+                const char* skipReason = nullptr;
+
+                tokens.clear();
+
+                if (!reader.Load(files, range, data)) HandleFatalError("Couldn't read file: " + files[range.file]);
+
+                if (DetectCompression(data.data(), data.size()) != CompressNone) {
+                    skipReason = "Skipping compressed file: ";
+                } else if (!IsUTF8orASCII(std::string(data.substr(0, 2)))) {
+                    skipReason = "Skipping file: ";
+                } else {
+                    size_t rangeStart = NextSafeByteSplit(data.data(), data.size(), std::min<uint64_t>(range.begin, data.size()), words);
+                    size_t rangeEnd = NextSafeByteSplit(data.data(), data.size(), std::min<uint64_t>(range.end, data.size()), words);
+
+                    if (rangeStart < rangeEnd) {
+                        try {
+                            rangeText = converter.from_bytes(data.data() + rangeStart, data.data() + rangeEnd);
+                            StrToTokens(rangeText, tokens, words, true, &GetThreadWordCache(), &fastTables);
+                        } catch (std::range_error&) {
+                            skipReason = "Skipping invalid UTF8 in file: ";
+                        }
+                    }
+                }
+
+                std::unique_lock<std::mutex> outLock(output.lock);
+
+                output.parts[range.begin].swap(tokens);
+                if (skipReason != nullptr) output.skipReason = skipReason;
+
+                if (--output.pendingRanges > 0) continue;
+
+                outLock.unlock();
+
+                // the last range of a file to finish writes all of it, a skipped range skips the whole file
+                if (output.skipReason != nullptr) {
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    std::cout << output.skipReason << files[range.file] << std::endl;
+                    output.parts.clear();
+                    continue;
+                }
+
+                FILE* pFile = fopen(out_files[range.file].c_str(), "wb");
+                if (pFile == NULL) HandleFatalError("Couldn't write file: " + out_files[range.file]);
+
+                for (auto& part : output.parts)
+                {
+                    if (fwrite(part.second.data(), sizeof(uint32_t), part.second.size(), pFile) != part.second.size())
+                        HandleFatalError("Couldn't write file: " + out_files[range.file]);
+                }
+
+                fclose(pFile);
+                output.parts.clear();
+
+                std::lock_guard<std::mutex> lock(logMutex);
+                std::cout << "Tokenized file: " << files[range.file] << std::endl;
+            }
+        });
+    }
+
+    inline void BuildTokenTable(const phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words,
+                                std::vector<std::u32string>& token_table)
+    {
+        token_table.clear();
+        token_table.resize(words.size());
+
+        for (const auto& n : words)
+        {
+            if (n.second >= token_table.size()) token_table.resize(n.second+1);
+
+            token_table[n.second] = n.first;
+        }
+    }
+
     inline void TokensToStr(std::u32string& dest, const std::vector<uint32_t>& tokens,
                      phmap::parallel_flat_hash_map<std::u32string, uint32_t>& words)
     {
@@ -612,4 +2232,173 @@ namespace Worderizer {
             }
         }
     }
+    // much faster than searching the word map when token_table comes from BuildTokenTable
+    inline void TokensToStr(std::u32string& dest, const std::vector<uint32_t>& tokens,
+                     const std::vector<std::u32string>& token_table)
+    {
+        dest.clear();
+
+        for (const uint32_t& token : tokens)
+        {
+            if (token >= token_table.size()) {
+                HandleFatalError("Unknown token ID: "+std::to_string(token));
+            } else {
+                dest += token_table[token];
+            }
+        }
+    }
+
+    struct Vocabulary
+    {
+        phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+        std::vector<std::u32string> tokenTable;
+        FastTokenTables fastTables;
+        uint64_t version;
+
+        Vocabulary() : version(0) {};
+    };
+
+    inline std::unique_ptr<Vocabulary> LoadVocabulary(std::string map_file)
+    {
+        std::unique_ptr<Vocabulary> vocab(new Vocabulary());
+
+        LoadWordMap(vocab->words, map_file);
+        BuildTokenTable(vocab->words, vocab->tokenTable);
+        vocab->fastTables.Build(vocab->words);
+
+        return vocab;
+    }
+
+    // Holds the current vocabulary and lets another thread replace it while it is in use.
+    // Readers only bump a per-thread counter so they never lock or wait on a reload. Publish() swaps
+    // the pointer, flips the epoch and frees the old version once readers of the old epoch are done.
+    class VocabHandle
+    {
+    public:
+        class ReadGuard
+        {
+        public:
+            ReadGuard(ReadGuard&& other) : vocab(other.vocab), counter(other.counter) { other.counter = nullptr; }
+            ~ReadGuard() { if (counter != nullptr) counter->fetch_sub(1); }
+
+            ReadGuard(const ReadGuard&) = delete;
+            ReadGuard& operator=(const ReadGuard&) = delete;
+
+            const Vocabulary& operator*() const { return *vocab; }
+            const Vocabulary* operator->() const { return vocab; }
+
+        private:
+            friend class VocabHandle;
+
+            const Vocabulary* vocab;
+            std::atomic<uint64_t>* counter;
+
+            ReadGuard(const Vocabulary* v, std::atomic<uint64_t>* c) : vocab(v), counter(c) {};
+        };
+
+        VocabHandle() : currentVocab(nullptr), readEpoch(0), nextVersion(1) {};
+
+        explicit VocabHandle(std::unique_ptr<Vocabulary> vocab) : VocabHandle() { Publish(std::move(vocab)); }
+
+        ~VocabHandle() { delete currentVocab.load(); }
+
+        VocabHandle(const VocabHandle&) = delete;
+        VocabHandle& operator=(const VocabHandle&) = delete;
+
+        // the vocabulary stays valid until the guard is destroyed, even if a new one is published
+        ReadGuard Read()
+        {
+            // threads sharing a slot just share a counter, it only has to reach zero
+            thread_local const size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % ReaderSlots;
+
+            while (true)
+            {
+                uint64_t epoch = readEpoch.load();
+                std::atomic<uint64_t>& counter = readerCounts[epoch & 1][slot].count;
+                counter.fetch_add(1);
+
+                // a publish that flipped the epoch before the count was added won't wait for it, so try again
+                if (readEpoch.load() == epoch) return ReadGuard(currentVocab.load(), &counter);
+
+                counter.fetch_sub(1);
+            }
+        }
+
+        // blocks until no reader can still see the old vocabulary, call it from a background thread
+        void Publish(std::unique_ptr<Vocabulary> vocab)
+        {
+            std::lock_guard<std::mutex> lock(publishMutex);
+
+            // the word map may have changed since it was loaded and is frozen from here on, so the tables are built now
+            BuildTokenTable(vocab->words, vocab->tokenTable);
+            vocab->fastTables.Build(vocab->words);
+
+            vocab->version = nextVersion++;
+            WordMapVersion++;
+
+            Vocabulary* oldVocab = currentVocab.exchange(vocab.release());
+            uint64_t oldParity = readEpoch.fetch_add(1) & 1;
+
+            for (ReaderSlot& reader : readerCounts[oldParity])
+                while (reader.count.load() != 0) std::this_thread::yield();
+
+            delete oldVocab;
+        }
+
+        void Reload(std::string map_file)
+        {
+            // Publish() builds the tables
+            std::unique_ptr<Vocabulary> vocab(new Vocabulary());
+            LoadWordMap(vocab->words, map_file);
+            Publish(std::move(vocab));
+        }
+
+        std::thread ReloadAsync(std::string map_file)
+        {
+            return std::thread([this, map_file] { Reload(map_file); });
+        }
+
+        uint64_t Version()
+        {
+            return Read()->version;
+        }
+
+    private:
+        static constexpr size_t ReaderSlots = 64;
+
+        struct alignas(64) ReaderSlot
+        {
+            std::atomic<uint64_t> count;
+
+            ReaderSlot() : count(0) {};
+        };
+
+        std::atomic<Vocabulary*> currentVocab;
+        std::atomic<uint64_t> readEpoch;
+        ReaderSlot readerCounts[2][ReaderSlots];
+        uint64_t nextVersion;
+        std::mutex publishMutex;
+    };
+
+    inline bool StrToTokens(const std::u32string& str, std::vector<uint32_t>& dest, const Vocabulary& vocab,
+                     bool skip_unknowns=true, WordCache* cache=nullptr)
+    {
+        return StrToTokens(str, dest, vocab.words, skip_unknowns, cache, &vocab.fastTables);
+    }
+
+    inline bool StrToTokensParallel(const std::u32string& str, std::vector<uint32_t>& dest, const Vocabulary& vocab,
+                     bool skip_unknowns=true, size_t min_segment=1024*1024)
+    {
+        return StrToTokensParallel(str, dest, vocab.words, skip_unknowns, min_segment, &vocab.fastTables);
+    }
+
+    inline size_t CountTokens(const std::u32string& str, const Vocabulary& vocab, size_t limit=0, WordCache* cache=nullptr)
+    {
+        return CountTokens(str, vocab.words, limit, cache, &vocab.fastTables);
+    }
+
+    inline void TokensToStr(std::u32string& dest, const std::vector<uint32_t>& tokens, const Vocabulary& vocab)
+    {
+        TokensToStr(dest, tokens, vocab.tokenTable);
+    }
 };
@@ -0,0 +1,505 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Worderizer.h"
+
+// Tokenization server over a Unix domain socket so many processes can share one loaded word map.
+// Every message starts with two uint32 values in native byte order followed by the payload:
+//   request:  op, payload size, payload (UTF8 text for OpTokenize, uint32 tokens for OpDetokenize,
+//             uint64 limit followed by UTF8 text for OpCountTokens)
+//   response: status, payload size, payload (uint32 tokens, UTF8 text, uint64 count or a text report)
+
+namespace Worderizer {
+
+    enum ServerOp : uint32_t
+    {
+        OpTokenize = 1,
+        OpDetokenize = 2,
+        OpStats = 3,
+        OpCountTokens = 4
+    };
+
+    enum ServerStatus : uint32_t
+    {
+        StatusOk = 0,
+        StatusError = 1
+    };
+
+    inline uint32_t MaxRequestSize = 256*1024*1024;
+
+    inline bool ReadAll(int fd, void* data, size_t size)
+    {
+        char* dest = (char*)data;
+
+        while (size > 0)
+        {
+            ssize_t got = read(fd, dest, size);
+            if (got <= 0) return false;
+            dest += got;
+            size -= got;
+        }
+
+        return true;
+    }
+
+    inline bool WriteAll(int fd, const void* data, size_t size)
+    {
+        const char* src = (const char*)data;
+
+        while (size > 0)
+        {
+            ssize_t sent = send(fd, src, size, MSG_NOSIGNAL);
+            if (sent <= 0) return false;
+            src += sent;
+            size -= sent;
+        }
+
+        return true;
+    }
+
+    inline bool WriteMessage(int fd, uint32_t code, const void* payload, uint32_t size)
+    {
+        uint32_t header[2] = { code, size };
+        return WriteAll(fd, header, sizeof(header)) && WriteAll(fd, payload, size);
+    }
+
+    struct LatencyStats
+    {
+        uint64_t count;
+        double p50, p90, p99, p999, max;
+
+        LatencyStats() : count(0), p50(0), p90(0), p99(0), p999(0), max(0) {};
+    };
+
+    class TokenServer
+    {
+    public:
+        // a new vocabulary can be published to the handle while the server runs
+        TokenServer(VocabHandle& vocab, size_t worker_count=0, size_t max_batch=64, size_t max_samples=65536)
+            : vocabHandle(vocab), workerCount(worker_count ? worker_count : GetThreadCount()),
+              maxBatch(std::max<size_t>(max_batch, 1)), latencySamples(max_samples, 0),
+              sampleCount(0), listenFd(-1), isRunning(false), stopWorkers(false)
+        {}
+
+        ~TokenServer() { Stop(); }
+
+        TokenServer(const TokenServer&) = delete;
+        TokenServer& operator=(const TokenServer&) = delete;
+
+        bool Start(const std::string& socket_path)
+        {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+
+            if (socket_path.size() >= sizeof(addr.sun_path)) return false;
+
+            socket_path.copy(addr.sun_path, socket_path.size());
+            unlink(socket_path.c_str());
+
+            listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenFd < 0) return false;
+
+            if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 128) != 0) {
+                close(listenFd);
+                listenFd = -1;
+                return false;
+            }
+
+            socketPath = socket_path;
+            isRunning = true;
+            stopWorkers = false;
+
+            for (size_t i=0; i < workerCount; ++i)
+                workerThreads.emplace_back(&TokenServer::WorkerLoop, this);
+
+            acceptThread = std::thread(&TokenServer::AcceptLoop, this);
+            return true;
+        }
+
+        void Stop()
+        {
+            if (!isRunning.exchange(false)) return;
+
+            shutdown(listenFd, SHUT_RDWR);
+            acceptThread.join();
+            close(listenFd);
+
+            {
+                // connections finish their current request before the workers are stopped
+                std::unique_lock<std::mutex> lock(connMutex);
+                for (const int& fd : connFds) shutdown(fd, SHUT_RDWR);
+                connCond.wait(lock, [this] { return connFds.empty(); });
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                stopWorkers = true;
+            }
+
+            queueCond.notify_all();
+            for (std::thread& thread : workerThreads) thread.join();
+            workerThreads.clear();
+
+            unlink(socketPath.c_str());
+        }
+
+        LatencyStats GetLatencyStats()
+        {
+            LatencyStats result;
+            std::vector<uint32_t> samples;
+
+            {
+                std::lock_guard<std::mutex> lock(statsMutex);
+                result.count = sampleCount;
+                samples.assign(latencySamples.begin(), latencySamples.begin() + std::min<uint64_t>(sampleCount, latencySamples.size()));
+            }
+
+            if (samples.empty()) return result;
+
+            std::sort(samples.begin(), samples.end());
+
+            auto percentile = [&samples](double p) {
+                return samples[std::min<size_t>(samples.size()-1, p * samples.size())] / 1000.0;
+            };
+
+            result.p50 = percentile(0.5);
+            result.p90 = percentile(0.9);
+            result.p99 = percentile(0.99);
+            result.p999 = percentile(0.999);
+            result.max = samples.back() / 1000.0;
+            return result;
+        }
+
+        std::string LatencyReport()
+        {
+            LatencyStats stats(GetLatencyStats());
+            std::ostringstream report;
+
+            report << "Vocabulary version: " << vocabHandle.Version() << "\n"
+                   << "Requests: " << stats.count << "\n"
+                   << "Latency (ms) p50: " << stats.p50 << " p90: " << stats.p90
+                   << " p99: " << stats.p99 << " p99.9: " << stats.p999
+                   << " max: " << stats.max << "\n";
+
+            return report.str();
+        }
+
+    private:
+        struct Request
+        {
+            uint32_t op;
+            std::string payload;
+            std::string response;
+            uint32_t status;
+            bool done;
+            std::chrono::steady_clock::time_point arrival;
+            std::mutex doneMutex;
+            std::condition_variable doneCond;
+
+            Request() : op(0), status(StatusOk), done(false) {};
+        };
+
+        VocabHandle& vocabHandle;
+        size_t workerCount;
+        size_t maxBatch;
+
+        std::deque<Request*> requestQueue;
+        std::mutex queueMutex;
+        std::condition_variable queueCond;
+
+        // latency ring buffer in microseconds, only the newest samples are kept
+        std::vector<uint32_t> latencySamples;
+        uint64_t sampleCount;
+        std::mutex statsMutex;
+
+        std::list<int> connFds;
+        std::mutex connMutex;
+        std::condition_variable connCond;
+
+        std::vector<std::thread> workerThreads;
+        std::thread acceptThread;
+        std::string socketPath;
+        int listenFd;
+        std::atomic<bool> isRunning;
+        bool stopWorkers;
+
+        void AcceptLoop()
+        {
+            while (isRunning)
+            {
+                int fd = accept(listenFd, nullptr, nullptr);
+
+                if (fd < 0) {
+                    if (!isRunning) break;
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> lock(connMutex);
+
+                if (!isRunning) {
+                    close(fd);
+                    break;
+                }
+
+                connFds.push_back(fd);
+                std::thread(&TokenServer::ConnectionLoop, this, std::prev(connFds.end())).detach();
+            }
+        }
+
+        void ConnectionLoop(std::list<int>::iterator fd_it)
+        {
+            ServeConnection(*fd_it);
+
+            // Stop() waits for the list to empty so nothing may touch the server after this
+            std::lock_guard<std::mutex> lock(connMutex);
+            close(*fd_it);
+            connFds.erase(fd_it);
+            connCond.notify_all();
+        }
+
+        void ServeConnection(const int fd)
+        {
+            Request request;
+            uint32_t header[2];
+
+            while (isRunning && ReadAll(fd, header, sizeof(header)))
+            {
+                if (header[1] > MaxRequestSize) {
+                    std::string error("Request too large");
+                    WriteMessage(fd, StatusError, error.data(), error.size());
+                    break;
+                }
+
+                request.payload.resize(header[1]);
+                if (!ReadAll(fd, request.payload.data(), header[1])) break;
+
+                request.arrival = std::chrono::steady_clock::now();
+                request.op = header[0];
+                request.done = false;
+
+                if (request.op == OpStats) {
+                    request.response = LatencyReport();
+                    request.status = StatusOk;
+                } else {
+                    {
+                        std::lock_guard<std::mutex> lock(queueMutex);
+                        requestQueue.push_back(&request);
+                    }
+
+                    queueCond.notify_one();
+
+                    std::unique_lock<std::mutex> lock(request.doneMutex);
+                    request.doneCond.wait(lock, [&request] { return request.done; });
+                }
+
+                if (!WriteMessage(fd, request.status, request.response.data(), request.response.size())) break;
+            }
+        }
+
+        void WorkerLoop()
+        {
+            std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> converter;
+            WordCache cache;
+            std::vector<Request*> batch;
+            std::vector<uint32_t> tokens;
+            std::u32string text;
+
+            while (true)
+            {
+                batch.clear();
+                bool moreQueued = false;
+
+                {
+                    // take this worker's share of the queue so a burst of small requests is spread over every worker
+                    std::unique_lock<std::mutex> lock(queueMutex);
+                    queueCond.wait(lock, [this] { return !requestQueue.empty() || stopWorkers; });
+
+                    if (requestQueue.empty()) break;
+
+                    size_t takeCount = std::min(maxBatch, (requestQueue.size() + workerCount - 1) / workerCount);
+
+                    while (batch.size() < takeCount)
+                    {
+                        batch.push_back(requestQueue.front());
+                        requestQueue.pop_front();
+                    }
+
+                    moreQueued = !requestQueue.empty();
+                }
+
+                if (moreQueued) queueCond.notify_one();
+
+                // the whole batch finishes on this version even if a reload is published meanwhile
+                VocabHandle::ReadGuard vocab(vocabHandle.Read());
+
+                for (Request* request : batch)
+                {
+                    request->status = StatusOk;
+
+                    try {
+                        if (request->op == OpTokenize) {
+                            tokens.clear();
+                            text = converter.from_bytes(request->payload.data(), request->payload.data() + request->payload.size());
+                            StrToTokens(text, tokens, *vocab, true, &cache);
+                            request->response.assign((const char*)tokens.data(), tokens.size() * sizeof(uint32_t));
+                        } else if (request->op == OpCountTokens) {
+                            uint64_t limit = 0;
+                            if (request->payload.size() < sizeof(limit)) throw std::runtime_error("Missing token limit");
+                            memcpy(&limit, request->payload.data(), sizeof(limit));
+                            text = converter.from_bytes(request->payload.data() + sizeof(limit), request->payload.data() + request->payload.size());
+                            uint64_t count = CountTokens(text, *vocab, limit, &cache);
+                            request->response.assign((const char*)&count, sizeof(count));
+                        } else if (request->op == OpDetokenize) {
+                            tokens.resize(request->payload.size() / sizeof(uint32_t));
+                            memcpy(tokens.data(), request->payload.data(), tokens.size() * sizeof(uint32_t));
+                            DetokenizeChecked(vocab->tokenTable, tokens, text);
+                            request->response = converter.to_bytes(text);
+                        } else {
+                            throw std::runtime_error("Unknown request type");
+                        }
+                    } catch (std::exception& e) {
+                        request->status = StatusError;
+                        request->response = e.what();
+                    }
+
+                    // each request is answered as soon as it is done instead of waiting for the batch
+                    RecordLatency(request);
+
+                    // notify under the lock, the request lives on the connection thread's stack
+                    std::lock_guard<std::mutex> lock(request->doneMutex);
+                    request->done = true;
+                    request->doneCond.notify_one();
+                }
+            }
+        }
+
+        void DetokenizeChecked(const std::vector<std::u32string>& token_table,
+                               const std::vector<uint32_t>& tokens, std::u32string& dest)
+        {
+            dest.clear();
+
+            for (const uint32_t& token : tokens)
+            {
+                if (token >= token_table.size())
+                    throw std::runtime_error("Unknown token ID: " + std::to_string(token));
+
+                dest += token_table[token];
+            }
+        }
+
+        void RecordLatency(const Request* request)
+        {
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request->arrival).count();
+
+            std::lock_guard<std::mutex> lock(statsMutex);
+            latencySamples[sampleCount++ % latencySamples.size()] = std::min<int64_t>(micros, UINT32_MAX);
+        }
+    };
+
+    class TokenClient
+    {
+    public:
+        TokenClient() : sockFd(-1) {};
+        ~TokenClient() { Close(); }
+
+        TokenClient(const TokenClient&) = delete;
+        TokenClient& operator=(const TokenClient&) = delete;
+
+        bool Connect(const std::string& socket_path)
+        {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+
+            if (socket_path.size() >= sizeof(addr.sun_path)) return false;
+
+            socket_path.copy(addr.sun_path, socket_path.size());
+
+            Close();
+            sockFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (sockFd < 0) return false;
+
+            if (connect(sockFd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                Close();
+                return false;
+            }
+
+            return true;
+        }
+
+        void Close()
+        {
+            if (sockFd >= 0) close(sockFd);
+            sockFd = -1;
+        }
+
+        bool Tokenize(const std::string& utf8_text, std::vector<uint32_t>& tokens)
+        {
+            if (!Call(OpTokenize, utf8_text.data(), utf8_text.size())) return false;
+
+            tokens.resize(responseData.size() / sizeof(uint32_t));
+            memcpy(tokens.data(), responseData.data(), tokens.size() * sizeof(uint32_t));
+            return true;
+        }
+
+        bool Detokenize(const std::vector<uint32_t>& tokens, std::string& utf8_text)
+        {
+            if (!Call(OpDetokenize, tokens.data(), tokens.size() * sizeof(uint32_t))) return false;
+
+            utf8_text = responseData;
+            return true;
+        }
+
+        // with limit > 0 the server stops counting early and returns limit+1 once it is exceeded
+        bool CountTokens(const std::string& utf8_text, uint64_t& count, uint64_t limit=0)
+        {
+            std::string payload((const char*)&limit, sizeof(limit));
+            payload += utf8_text;
+
+            if (!Call(OpCountTokens, payload.data(), payload.size()) || responseData.size() != sizeof(count)) return false;
+
+            memcpy(&count, responseData.data(), sizeof(count));
+            return true;
+        }
+
+        bool Stats(std::string& report)
+        {
+            if (!Call(OpStats, nullptr, 0)) return false;
+
+            report = responseData;
+            return true;
+        }
+
+        // error message from the server after a failed call
+        const std::string& LastError() const { return responseData; }
+
+    private:
+        int sockFd;
+        std::string responseData;
+
+        bool Call(uint32_t op, const void* payload, size_t size)
+        {
+            uint32_t header[2];
+
+            responseData.clear();
+
+            if (sockFd < 0 || size > MaxRequestSize) return false;
+            if (!WriteMessage(sockFd, op, payload, size) || !ReadAll(sockFd, header, sizeof(header))) return false;
+
+            responseData.resize(header[1]);
+            if (!ReadAll(sockFd, responseData.data(), header[1])) return false;
+
+            return header[0] == StatusOk;
+        }
+    };
+};
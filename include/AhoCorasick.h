@@ -0,0 +1,156 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <cstdint>
+#include "ReadWrite.h"
+#include "FileTasks.h"
+
+// Byte-level Aho-Corasick automaton for counting many patterns in one pass.
+// Counts include overlapping occurrences, duplicate patterns get the same count.
+class AhoCorasick
+{
+public:
+    AhoCorasick(const std::vector<std::string>& patterns) : patternCount(patterns.size()), maxPatternLen(0)
+    {
+        std::vector<std::vector<uint32_t>> stateOutputs(1);
+        std::vector<uint32_t> failLinks(1, 0);
+
+        gotoTable.assign(256, 0);
+
+        for (size_t p=0; p < patterns.size(); ++p)
+        {
+            uint32_t state = 0;
+
+            for (const char& c : patterns[p])
+            {
+                uint32_t& next = gotoTable[state * 256 + (uint8_t)c];
+
+                if (next == 0) {
+                    next = stateOutputs.size();
+                    stateOutputs.emplace_back();
+                    gotoTable.resize(gotoTable.size() + 256, 0);
+                }
+
+                state = gotoTable[state * 256 + (uint8_t)c];
+            }
+
+            if (patterns[p].empty()) continue;
+
+            stateOutputs[state].push_back(p);
+
+            if (patterns[p].size() > maxPatternLen) maxPatternLen = patterns[p].size();
+        }
+
+        failLinks.resize(stateOutputs.size(), 0);
+
+        // breadth-first pass turns the trie into a full DFA and merges suffix outputs
+        std::deque<uint32_t> stateQueue;
+
+        for (uint32_t c=0; c < 256; ++c)
+            if (gotoTable[c] != 0) stateQueue.push_back(gotoTable[c]);
+
+        while (!stateQueue.empty())
+        {
+            uint32_t state = stateQueue.front();
+            stateQueue.pop_front();
+
+            const std::vector<uint32_t>& failOut = stateOutputs[failLinks[state]];
+            stateOutputs[state].insert(stateOutputs[state].end(), failOut.begin(), failOut.end());
+
+            for (uint32_t c=0; c < 256; ++c)
+            {
+                uint32_t& next = gotoTable[state * 256 + c];
+                uint32_t failNext = gotoTable[failLinks[state] * 256 + c];
+
+                if (next != 0) {
+                    failLinks[next] = failNext;
+                    stateQueue.push_back(next);
+                } else {
+                    next = failNext;
+                }
+            }
+        }
+
+        outputStart.reserve(stateOutputs.size() + 1);
+
+        for (const std::vector<uint32_t>& outputs : stateOutputs)
+        {
+            outputStart.push_back(outputList.size());
+            outputList.insert(outputList.end(), outputs.begin(), outputs.end());
+        }
+
+        outputStart.push_back(outputList.size());
+    }
+
+    size_t PatternCount() const { return patternCount; }
+    size_t MaxPatternLen() const { return maxPatternLen; }
+
+    // scans data starting from state and returns the final state so scans can continue across buffers
+    // only matches ending at or after count_from are counted
+    uint32_t Scan(const char* data, size_t size, std::vector<uint64_t>& counts,
+                  uint32_t state=0, size_t count_from=0) const
+    {
+        counts.resize(patternCount, 0);
+
+        for (size_t i=0; i < size; ++i)
+        {
+            state = gotoTable[state * 256 + (uint8_t)data[i]];
+
+            if (outputStart[state] != outputStart[state+1] && i >= count_from) {
+                for (uint32_t o=outputStart[state]; o < outputStart[state+1]; ++o)
+                    counts[outputList[o]]++;
+            }
+        }
+
+        return state;
+    }
+
+    void Count(std::string_view text, std::vector<uint64_t>& counts) const
+    {
+        Scan(text.data(), text.size(), counts);
+    }
+
+private:
+    size_t patternCount;
+    size_t maxPatternLen;
+    std::vector<uint32_t> gotoTable;
+    std::vector<uint32_t> outputStart;
+    std::vector<uint32_t> outputList;
+};
+
+// counts every pattern across all files in one pass per file, large files are split between threads
+inline void CountPatternsInFiles(const AhoCorasick& automaton, const std::vector<std::string>& files,
+                                 std::vector<uint64_t>& counts, size_t thread_count=0,
+                                 size_t chunk_size=0)
+{
+    if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<FileTask> scanTasks(PlanFileTasks(files, thread_count, chunk_size));
+    std::vector<std::vector<uint64_t>> threadCounts(thread_count);
+
+    RunWorkStealing(scanTasks, thread_count, [&](const FileTask& task, size_t t) {
+        FileRangeReader reader;
+        std::string_view data;
+
+        for (const FileRange& range : task.ranges)
+        {
+            if (!reader.Load(files, range, data)) HandleFatalError("Couldn't open file: " + files[range.file]);
+
+            // back up so matches crossing into this range are found, but only count those ending inside it
+            size_t overlap = std::min<uint64_t>(range.begin, automaton.MaxPatternLen() > 0 ? automaton.MaxPatternLen()-1 : 0);
+            size_t scanBegin = range.begin - overlap;
+            size_t scanEnd = std::min<uint64_t>(range.end, data.size());
+
+            if (scanBegin < scanEnd)
+                automaton.Scan(data.data() + scanBegin, scanEnd - scanBegin, threadCounts[t], 0, overlap);
+        }
+    });
+
+    counts.assign(automaton.PatternCount(), 0);
+
+    for (const std::vector<uint64_t>& tc : threadCounts)
+        for (size_t p=0; p < tc.size(); ++p) counts[p] += tc[p];
+}
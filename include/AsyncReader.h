@@ -0,0 +1,259 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "ReadWrite.h"
+
+#ifdef WORDERIZER_USE_IO_URING
+    #include <liburing.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+struct FileBuffer
+{
+    std::string path;
+    std::string data;
+    size_t index;
+    size_t offset;
+    int fd;
+    bool ok;
+
+    FileBuffer() : index(0), offset(0), fd(-1), ok(false) {};
+};
+
+// Reads files from a list in the background while the caller processes earlier ones.
+// Buffers come from a fixed pool and are returned with Release() so their memory is reused.
+// Files are always handed out in list order, failed reads have ok set to false.
+class AsyncFileReader
+{
+public:
+    AsyncFileReader(const std::vector<std::string>& files, size_t pool_size=4)
+        : fileList(files), stopReading(false), readDone(false)
+    {
+        if (pool_size < 2) pool_size = 2;
+
+        bufferPool.resize(pool_size);
+
+        for (FileBuffer& buffer : bufferPool) freeBuffers.push_back(&buffer);
+
+        readThread = std::thread(&AsyncFileReader::ReadLoop, this);
+    }
+
+    ~AsyncFileReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            stopReading = true;
+        }
+
+        freeCond.notify_all();
+        readThread.join();
+    }
+
+    AsyncFileReader(const AsyncFileReader&) = delete;
+    AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+    // blocks until the next file is loaded, returns nullptr once every file was handed out
+    FileBuffer* Next()
+    {
+        std::unique_lock<std::mutex> lock(readMutex);
+        readyCond.wait(lock, [this] { return !readyBuffers.empty() || readDone; });
+
+        if (readyBuffers.empty()) return nullptr;
+
+        FileBuffer* buffer = readyBuffers.front();
+        readyBuffers.pop_front();
+        return buffer;
+    }
+
+    void Release(FileBuffer* buffer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            freeBuffers.push_back(buffer);
+        }
+
+        freeCond.notify_one();
+    }
+
+private:
+    std::vector<std::string> fileList;
+    std::vector<FileBuffer> bufferPool;
+    std::deque<FileBuffer*> freeBuffers;
+    std::deque<FileBuffer*> readyBuffers;
+    std::mutex readMutex;
+    std::condition_variable freeCond;
+    std::condition_variable readyCond;
+    std::thread readThread;
+    bool stopReading;
+    bool readDone;
+
+    FileBuffer* TakeFreeBuffer(bool wait)
+    {
+        std::unique_lock<std::mutex> lock(readMutex);
+
+        if (wait) freeCond.wait(lock, [this] { return !freeBuffers.empty() || stopReading; });
+
+        if (stopReading || freeBuffers.empty()) return nullptr;
+
+        FileBuffer* buffer = freeBuffers.front();
+        freeBuffers.pop_front();
+        return buffer;
+    }
+
+    void PushReady(FileBuffer* buffer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readyBuffers.push_back(buffer);
+        }
+
+        readyCond.notify_one();
+    }
+
+    void FinishReading()
+    {
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readDone = true;
+        }
+
+        readyCond.notify_all();
+    }
+
+    void ReadLoop()
+    {
+#ifdef WORDERIZER_USE_IO_URING
+        if (UringReadLoop()) {
+            FinishReading();
+            return;
+        }
+#endif
+        for (size_t i=0; i < fileList.size(); ++i)
+        {
+            FileBuffer* buffer = TakeFreeBuffer(true);
+            if (buffer == nullptr) break;
+
+            buffer->path = fileList[i];
+            buffer->index = i;
+            buffer->ok = ReadFileInto(buffer->path, buffer->data);
+
+            PushReady(buffer);
+        }
+
+        FinishReading();
+    }
+
+#ifdef WORDERIZER_USE_IO_URING
+    // the read size is an unsigned, so large files are read in 1 GB pieces through the short read path
+    void QueueUringRead(io_uring& ring, FileBuffer* buffer)
+    {
+        size_t readSize = std::min<size_t>(buffer->data.size() - buffer->offset, 1024*1024*1024);
+
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_read(sqe, buffer->fd, buffer->data.data() + buffer->offset, readSize, buffer->offset);
+        io_uring_sqe_set_data(sqe, buffer);
+    }
+
+    // keeps one read in flight per free buffer, returns false if io_uring is unavailable
+    bool UringReadLoop()
+    {
+        io_uring ring;
+
+        if (io_uring_queue_init(bufferPool.size(), &ring, 0) < 0) return false;
+
+        std::map<size_t, FileBuffer*> doneBuffers;
+        size_t nextFile = 0;
+        size_t nextReady = 0;
+        size_t inFlight = 0;
+
+        while (nextReady < fileList.size())
+        {
+            while (nextFile < fileList.size())
+            {
+                FileBuffer* buffer = TakeFreeBuffer(inFlight == 0 && doneBuffers.empty());
+                if (buffer == nullptr) break;
+
+                buffer->path = fileList[nextFile];
+                buffer->index = nextFile++;
+                buffer->offset = 0;
+                buffer->ok = false;
+                buffer->fd = open(buffer->path.c_str(), O_RDONLY);
+
+                long long fileSize = (buffer->fd < 0) ? -1 : FileSize(buffer->path);
+
+                if (fileSize <= 0) {
+                    if (buffer->fd >= 0) close(buffer->fd);
+                    buffer->data.clear();
+                    buffer->ok = (fileSize == 0);
+                    doneBuffers[buffer->index] = buffer;
+                    continue;
+                }
+
+                buffer->data.resize(fileSize);
+
+                QueueUringRead(ring, buffer);
+                inFlight++;
+            }
+
+            if (inFlight > 0) {
+
+                io_uring_cqe* cqe = nullptr;
+                io_uring_submit(&ring);
+
+                if (io_uring_wait_cqe(&ring, &cqe) < 0) break;
+
+                FileBuffer* buffer = (FileBuffer*)io_uring_cqe_get_data(cqe);
+                int result = cqe->res;
+                io_uring_cqe_seen(&ring, cqe);
+
+                if (result > 0 && buffer->offset + result < buffer->data.size()) {
+                    // short read, queue the remaining bytes
+                    buffer->offset += result;
+                    QueueUringRead(ring, buffer);
+                    continue;
+                }
+
+                inFlight--;
+                close(buffer->fd);
+
+                if (result >= 0) {
+                    buffer->data.resize(buffer->offset + result);
+                    buffer->ok = true;
+                }
+
+                doneBuffers[buffer->index] = buffer;
+
+            } else if (doneBuffers.empty()) {
+                break;
+            }
+
+            // completions arrive out of order but files are handed out in list order
+            while (!doneBuffers.empty() && doneBuffers.begin()->first == nextReady)
+            {
+                PushReady(doneBuffers.begin()->second);
+                doneBuffers.erase(doneBuffers.begin());
+                nextReady++;
+            }
+        }
+
+        while (inFlight > 0)
+        {
+            io_uring_cqe* cqe = nullptr;
+            if (io_uring_wait_cqe(&ring, &cqe) < 0) break;
+            close(((FileBuffer*)io_uring_cqe_get_data(cqe))->fd);
+            io_uring_cqe_seen(&ring, cqe);
+            inFlight--;
+        }
+
+        io_uring_queue_exit(&ring);
+        return true;
+    }
+#endif
+};
@@ -0,0 +1,319 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#ifdef WORDERIZER_USE_ZLIB
+    #include <zlib.h>
+#endif
+
+#ifdef WORDERIZER_USE_ZSTD
+    #include <zstd.h>
+#endif
+
+enum CompressionType
+{
+    CompressNone,
+    CompressGzip,
+    CompressZstd
+};
+
+inline CompressionType DetectCompression(const char* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    if (size >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B) return CompressGzip;
+    if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD) return CompressZstd;
+
+    return CompressNone;
+}
+
+inline CompressionType DetectFileCompression(const std::string& filename)
+{
+    char magic[4];
+    FILE* pFile = fopen(filename.c_str(), "rb");
+    if (pFile == NULL) return CompressNone;
+
+    size_t readSize = fread(magic, 1, sizeof(magic), pFile);
+    fclose(pFile);
+
+    return DetectCompression(magic, readSize);
+}
+
+// true if this build can decompress the given type
+inline bool CanDecompress(CompressionType type)
+{
+#ifdef WORDERIZER_USE_ZLIB
+    if (type == CompressGzip) return true;
+#endif
+#ifdef WORDERIZER_USE_ZSTD
+    if (type == CompressZstd) return true;
+#endif
+    return type == CompressNone;
+}
+
+// Decompresses gzip or zstd data on a background thread and hands out the output in chunks,
+// so the caller can process one chunk while the next is being decompressed.
+// The compressed data must stay valid until the reader is destroyed.
+class DecompressReader
+{
+public:
+    DecompressReader(std::string_view data, size_t chunk_size=4*1024*1024, size_t pool_size=3)
+        : inputData(data), chunkSize(chunk_size), lastChunk(nullptr), stopReading(false), readDone(false), readOk(true)
+    {
+        if (pool_size < 2) pool_size = 2;
+
+        chunkPool.resize(pool_size);
+
+        for (std::string& chunk : chunkPool) freeChunks.push_back(&chunk);
+
+        readThread = std::thread(&DecompressReader::ReadLoop, this);
+    }
+
+    ~DecompressReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            stopReading = true;
+        }
+
+        freeCond.notify_all();
+        readThread.join();
+    }
+
+    DecompressReader(const DecompressReader&) = delete;
+    DecompressReader& operator=(const DecompressReader&) = delete;
+
+    // blocks until the next chunk is ready and gives the previous one back, returns nullptr at the end
+    const std::string* Next()
+    {
+        std::unique_lock<std::mutex> lock(readMutex);
+
+        if (lastChunk != nullptr) {
+            freeChunks.push_back(lastChunk);
+            lastChunk = nullptr;
+            freeCond.notify_one();
+        }
+
+        readyCond.wait(lock, [this] { return !readyChunks.empty() || readDone; });
+
+        if (readyChunks.empty()) return nullptr;
+
+        lastChunk = readyChunks.front();
+        readyChunks.pop_front();
+        return lastChunk;
+    }
+
+    // false if the data was corrupt, truncated or of a type this build can't decompress
+    bool Ok()
+    {
+        std::lock_guard<std::mutex> lock(readMutex);
+        return readOk;
+    }
+
+private:
+    std::string_view inputData;
+    size_t chunkSize;
+    std::vector<std::string> chunkPool;
+    std::deque<std::string*> freeChunks;
+    std::deque<std::string*> readyChunks;
+    std::string* lastChunk;
+    std::mutex readMutex;
+    std::condition_variable freeCond;
+    std::condition_variable readyCond;
+    std::thread readThread;
+    bool stopReading;
+    bool readDone;
+    bool readOk;
+
+    std::string* TakeFreeChunk()
+    {
+        std::unique_lock<std::mutex> lock(readMutex);
+        freeCond.wait(lock, [this] { return !freeChunks.empty() || stopReading; });
+
+        if (stopReading) return nullptr;
+
+        std::string* chunk = freeChunks.front();
+        freeChunks.pop_front();
+        return chunk;
+    }
+
+    void PushReady(std::string* chunk)
+    {
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readyChunks.push_back(chunk);
+        }
+
+        readyCond.notify_one();
+    }
+
+    // output is collected in a chunk from the pool and handed out whenever it is full
+    template <typename Step>
+    void DecompressChunks(Step&& step)
+    {
+        std::string* chunk = TakeFreeChunk();
+        size_t chunkFill = 0;
+        bool finished = false;
+
+        while (chunk != nullptr)
+        {
+            chunk->resize(chunkSize);
+
+            while (chunkFill < chunkSize && !finished)
+            {
+                size_t written = 0;
+
+                if (!step(chunk->data() + chunkFill, chunkSize - chunkFill, written, finished)) {
+                    std::lock_guard<std::mutex> lock(readMutex);
+                    readOk = false;
+                    finished = true;
+                }
+
+                chunkFill += written;
+            }
+
+            chunk->resize(chunkFill);
+
+            if (chunkFill > 0) {
+                PushReady(chunk);
+                chunk = finished ? nullptr : TakeFreeChunk();
+            } else if (finished) {
+                std::lock_guard<std::mutex> lock(readMutex);
+                freeChunks.push_back(chunk);
+                chunk = nullptr;
+            }
+
+            chunkFill = 0;
+        }
+    }
+
+    void ReadLoop()
+    {
+        CompressionType type = DetectCompression(inputData.data(), inputData.size());
+
+        if (type == CompressNone) {
+            // plain data is handed out as is
+            DecompressChunks([this, pos = (size_t)0](char* dest, size_t size, size_t& written, bool& finished) mutable {
+                written = std::min(size, inputData.size() - pos);
+                memcpy(dest, inputData.data() + pos, written);
+                pos += written;
+                finished = (pos == inputData.size());
+                return true;
+            });
+#ifdef WORDERIZER_USE_ZLIB
+        } else if (type == CompressGzip) {
+            GzipLoop();
+#endif
+#ifdef WORDERIZER_USE_ZSTD
+        } else if (type == CompressZstd) {
+            ZstdLoop();
+#endif
+        } else {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readOk = false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readDone = true;
+        }
+
+        readyCond.notify_all();
+    }
+
+#ifdef WORDERIZER_USE_ZLIB
+    void GzipLoop()
+    {
+        z_stream stream = {};
+
+        // 15+32 detects the gzip header, concatenated members are read one after another
+        if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readOk = false;
+            return;
+        }
+
+        size_t inputPos = 0;
+
+        DecompressChunks([&](char* dest, size_t size, size_t& written, bool& finished) {
+            // avail_in and avail_out are 32 bit, large buffers are fed in pieces
+            uInt inputSize = (uInt)std::min<size_t>(inputData.size() - inputPos, UINT32_MAX);
+            uInt outputSize = (uInt)std::min<size_t>(size, UINT32_MAX);
+
+            stream.next_in = (Bytef*)inputData.data() + inputPos;
+            stream.avail_in = inputSize;
+            stream.next_out = (Bytef*)dest;
+            stream.avail_out = outputSize;
+
+            int result = inflate(&stream, Z_NO_FLUSH);
+
+            inputPos += inputSize - stream.avail_in;
+            written = outputSize - stream.avail_out;
+
+            if (result == Z_STREAM_END) {
+                if (inputPos < inputData.size() && DetectCompression(inputData.data() + inputPos, inputData.size() - inputPos) == CompressGzip) {
+                    inflateReset(&stream);
+                } else {
+                    finished = true;
+                }
+                return true;
+            }
+
+            if (result == Z_BUF_ERROR && inputPos == inputData.size()) {
+                finished = true;
+                return false;
+            }
+
+            return result == Z_OK || result == Z_BUF_ERROR;
+        });
+
+        inflateEnd(&stream);
+    }
+#endif
+
+#ifdef WORDERIZER_USE_ZSTD
+    void ZstdLoop()
+    {
+        ZSTD_DCtx* context = ZSTD_createDCtx();
+        ZSTD_inBuffer input = { inputData.data(), inputData.size(), 0 };
+        size_t frameLeft = 1;
+
+        if (context == nullptr) {
+            std::lock_guard<std::mutex> lock(readMutex);
+            readOk = false;
+            return;
+        }
+
+        // concatenated frames are decompressed one after another by the same stream
+        DecompressChunks([&](char* dest, size_t size, size_t& written, bool& finished) {
+            ZSTD_outBuffer output = { dest, size, 0 };
+
+            frameLeft = ZSTD_decompressStream(context, &output, &input);
+            written = output.pos;
+
+            if (ZSTD_isError(frameLeft)) {
+                finished = true;
+                return false;
+            }
+
+            if (input.pos == input.size && output.pos < output.size) {
+                finished = true;
+                return frameLeft == 0;
+            }
+
+            return true;
+        });
+
+        ZSTD_freeDCtx(context);
+    }
+#endif
+};
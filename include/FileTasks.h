@@ -0,0 +1,187 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include "ReadWrite.h"
+
+// part of one file, split is false when the range covers the whole file
+struct FileRange
+{
+    size_t file;
+    uint64_t begin;
+    uint64_t end;
+    bool split;
+};
+
+// one unit of scheduled work, either a range of a large file or a batch of small whole files
+struct FileTask
+{
+    std::vector<FileRange> ranges;
+    uint64_t bytes;
+
+    FileTask() : bytes(0) {};
+};
+
+// Plans tasks of roughly task_size bytes from the file sizes. Files larger than task_size are cut into
+// equal ranges (callers move the range edges to a boundary that suits them), smaller files are batched.
+// can_split is asked before a file is cut, files it rejects (e.g. compressed) get a task of their own.
+// With task_size 0 a size is picked so every thread gets several tasks. Tasks are returned largest first.
+inline std::vector<FileTask> PlanFileTasks(const std::vector<std::string>& files, size_t thread_count,
+                                           uint64_t task_size=0, const std::function<bool(size_t)>& can_split=nullptr)
+{
+    std::vector<long long> fileSizes;
+    std::vector<FileTask> tasks;
+    uint64_t totalBytes = 0;
+
+    for (const std::string& file : files)
+    {
+        fileSizes.push_back(FileSize(file));
+        if (fileSizes.back() < 0) HandleFatalError("Couldn't open file: " + file);
+        totalBytes += fileSizes.back();
+    }
+
+    if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    if (task_size == 0)
+        task_size = std::clamp<uint64_t>(totalBytes / (thread_count * 16), 1024*1024, 64*1024*1024);
+
+    FileTask batch;
+
+    for (size_t f=0; f < files.size(); ++f)
+    {
+        uint64_t fileSize = fileSizes[f];
+
+        if (fileSize > task_size) {
+
+            uint64_t rangeCount = (can_split == nullptr || can_split(f)) ? (fileSize + task_size - 1) / task_size : 1;
+
+            for (uint64_t r=0; r < rangeCount; ++r)
+            {
+                FileTask task;
+                task.ranges.push_back({f, fileSize * r / rangeCount, fileSize * (r+1) / rangeCount, rangeCount > 1});
+                task.bytes = task.ranges[0].end - task.ranges[0].begin;
+                tasks.push_back(std::move(task));
+            }
+
+        } else {
+
+            batch.ranges.push_back({f, 0, fileSize, false});
+            batch.bytes += fileSize;
+
+            if (batch.bytes >= task_size) {
+                tasks.push_back(std::move(batch));
+                batch = FileTask();
+            }
+        }
+    }
+
+    if (!batch.ranges.empty()) tasks.push_back(std::move(batch));
+
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const FileTask& a, const FileTask& b) { return a.bytes > b.bytes; });
+
+    return tasks;
+}
+
+// Calls work(task, thread_index) for every task on thread_count threads. Tasks are dealt out round robin,
+// each thread works through its own queue from the front and then steals from the back of the others.
+template <typename Task, typename Work>
+inline void RunWorkStealing(std::vector<Task>& tasks, size_t thread_count, Work&& work)
+{
+    struct TaskQueue
+    {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+    if (thread_count > tasks.size()) thread_count = std::max((size_t)1, tasks.size());
+
+    if (thread_count == 1) {
+        for (Task& task : tasks) work(task, 0);
+        return;
+    }
+
+    std::vector<TaskQueue> queues(thread_count);
+    std::vector<std::thread> threads;
+
+    for (size_t i=0; i < tasks.size(); ++i)
+        queues[i % thread_count].tasks.push_back(i);
+
+    auto takeTask = [&](size_t t, size_t& index) -> bool
+    {
+        for (size_t q=0; q < thread_count; ++q)
+        {
+            TaskQueue& queue = queues[(t + q) % thread_count];
+            std::lock_guard<std::mutex> lock(queue.lock);
+
+            if (queue.tasks.empty()) continue;
+
+            if (q == 0) {
+                index = queue.tasks.front();
+                queue.tasks.pop_front();
+            } else {
+                index = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+
+            return true;
+        }
+
+        return false;
+    };
+
+    for (size_t t=0; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t] {
+            size_t index = 0;
+            while (takeTask(t, index)) work(tasks[index], t);
+        });
+    }
+
+    for (std::thread& thread : threads) thread.join();
+}
+
+// Gives access to the file of each range a thread works on, keeping it open while ranges of it follow.
+// Split and large files are mapped, small whole files are read into a reused buffer.
+class FileRangeReader
+{
+public:
+    FileRangeReader(uint64_t map_size=16*1024*1024) : mapSize(map_size), openFile(SIZE_MAX) {};
+
+    // returns false if the file can't be read
+    bool Load(const std::vector<std::string>& files, const FileRange& range, std::string_view& data)
+    {
+        if (range.file != openFile) {
+
+            openFile = SIZE_MAX;
+            mappedFile.Close();
+
+            if (range.split || range.end >= mapSize) {
+                if (!mappedFile.Open(files[range.file])) return false;
+                fileData = mappedFile.View();
+            } else {
+                if (!ReadFileInto(files[range.file], fileBuffer)) return false;
+                fileData = fileBuffer;
+            }
+
+            openFile = range.file;
+        }
+
+        data = fileData;
+        return true;
+    }
+
+private:
+    MappedFile mappedFile;
+    std::string fileBuffer;
+    std::string_view fileData;
+    uint64_t mapSize;
+    size_t openFile;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <new>
+#include <atomic>
+#include <cstddef>
+
+#ifndef _WIN32
+    #include <sys/mman.h>
+#endif
+
+namespace Worderizer {
+    // defined in Worderizer.h with the other settings
+    extern std::atomic<bool> UseHugePages;
+}
+
+// Allocator for big hash tables. Blocks of at least HugePageSize bytes are mapped directly and, when
+// Worderizer::UseHugePages is set, marked for transparent huge pages so large tables need far fewer TLB entries.
+// Smaller blocks and platforms without madvise use the normal allocator.
+template <typename T>
+class HugePageAllocator
+{
+public:
+    using value_type = T;
+
+    static constexpr size_t HugePageSize = 2*1024*1024;
+
+    HugePageAllocator() noexcept {};
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) noexcept {};
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+        if (bytes >= HugePageSize) {
+            void* addr = mmap(nullptr, RoundUp(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addr == MAP_FAILED) throw std::bad_alloc();
+
+            if (Worderizer::UseHugePages) madvise(addr, RoundUp(bytes), MADV_HUGEPAGE);
+
+            return (T*)addr;
+        }
+#endif
+        return (T*)::operator new(bytes);
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept
+    {
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+        if (n * sizeof(T) >= HugePageSize) {
+            munmap(ptr, RoundUp(n * sizeof(T)));
+            return;
+        }
+#endif
+        ::operator delete(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const HugePageAllocator<U>&) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const HugePageAllocator<U>&) const noexcept { return false; }
+
+private:
+    static size_t RoundUp(size_t bytes) { return (bytes + HugePageSize - 1) / HugePageSize * HugePageSize; }
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+// HyperLogLog sketch, estimates how many distinct items were added from their 64 bit hashes.
+// Uses 2^precision one byte registers, the standard error is about 1.04 / sqrt(2^precision).
+class HyperLogLog
+{
+public:
+    HyperLogLog(uint8_t precision=14) : hashBits(std::clamp<uint8_t>(precision, 4, 18))
+    {
+        registers.assign((size_t)1 << hashBits, 0);
+    }
+
+    void Add(uint64_t hash)
+    {
+        // mixed first so weak hashes still spread over every register
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        hash *= 0xC4CEB9FE1A85EC53ULL;
+        hash ^= hash >> 33;
+
+        size_t index = hash >> (64 - hashBits);
+        uint64_t rest = hash << hashBits;
+        uint8_t rank = 1;
+
+        while (rank <= 64 - hashBits && (rest & 0x8000000000000000ULL) == 0)
+        {
+            rest <<= 1;
+            rank++;
+        }
+
+        if (rank > registers[index]) registers[index] = rank;
+    }
+
+    // afterwards the sketch counts the union of both, precisions must match
+    void Merge(const HyperLogLog& other)
+    {
+        if (other.registers.size() != registers.size()) return;
+
+        for (size_t r=0; r < registers.size(); ++r)
+            registers[r] = std::max(registers[r], other.registers[r]);
+    }
+
+    double Estimate() const
+    {
+        double registerCount = registers.size();
+        double sum = 0;
+        size_t emptyRegisters = 0;
+
+        for (uint8_t rank : registers)
+        {
+            sum += std::ldexp(1.0, -rank);
+            if (rank == 0) emptyRegisters++;
+        }
+
+        double estimate = (0.7213 / (1.0 + 1.079 / registerCount)) * registerCount * registerCount / sum;
+
+        // linear counting is more accurate while many registers are still empty
+        if (estimate <= 2.5 * registerCount && emptyRegisters > 0)
+            estimate = registerCount * std::log(registerCount / emptyRegisters);
+
+        return estimate;
+    }
+
+    void Clear() { std::fill(registers.begin(), registers.end(), 0); }
+
+private:
+    uint8_t hashBits;
+    std::vector<uint8_t> registers;
+};
@@ -4,6 +4,8 @@
 #include <fstream>
 #include <filesystem>
 #include <vector>
+#include <string_view>
+#include <cstring>
 #include <assert.h>
 #include <sys/stat.h>
 #include "StringExt.h"
@@ -16,6 +18,8 @@
     #define mkdir    _mkdir
 #else
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
 #endif
 
 inline bool DirExists(const std::string& dirname)
@@ -32,7 +36,11 @@ inline bool DirExists(const std::string& dirname)
 
 inline bool CreateDir(const std::string& dirname)
 {
+#ifdef _WIN32
     return (mkdir(dirname.c_str()) == 0) ? true : false;
+#else
+    return (mkdir(dirname.c_str(), 0755) == 0) ? true : false;
+#endif
 }
 
 inline bool FileExists(const std::string& filename)
@@ -96,6 +104,24 @@ inline std::string ReadFileStr(const std::string filename)
     return fileStr;
 }
 
+inline bool ReadFileInto(const std::string& filename, std::string& dest)
+{
+    FILE* pFile = fopen(filename.c_str(), "rb");
+    if (pFile == NULL) return false;
+
+    long long fileSize = FileSize(filename);
+    if (fileSize < 0) fileSize = 0;
+
+    // resize keeps the existing allocation so reused buffers stop reallocating
+    dest.resize(fileSize);
+
+    size_t readSize = fread(dest.data(), 1, dest.size(), pFile);
+    dest.resize(readSize);
+
+    fclose(pFile);
+    return true;
+}
+
 inline void WriteFileStr(const std::string filename, const std::string str, bool append=false)
 {
 	std::ofstream destFile;
@@ -184,51 +210,138 @@ inline size_t CountStrInFile(const std::string& filename, const std::string& str
 	return result;
 }
 
-inline void SplitTextFile(const std::string& filename, const std::string& sep,
-                          std::vector<std::string>& dest, size_t min_chunk_len=2)
+class MappedFile
 {
-	std::string word(sep.length(), 0);
-	std::string textChunk;
-	size_t startIndex = 0;
-	size_t endIndex = 0;
+public:
+    MappedFile() : fileData(nullptr), fileSize(0), isMapped(false) {};
+
+    explicit MappedFile(const std::string& filename) : MappedFile()
+    {
+        if (!Open(filename)) HandleFatalError("Couldn't open file: " + filename);
+    }
+
+    ~MappedFile() { Close(); }
 
-    FILE* pFile = nullptr;
-    errno_t err = fopen_s(&pFile, filename.c_str(), "rb");
-    if (err != 0 || pFile == nullptr) HandleFatalError("failed to open "+filename);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    while (fread(word.data(), 1, sep.size(), pFile) == sep.length())
+    // maps the file read-only, falls back to reading it into memory if mapping fails
+    bool Open(const std::string& filename)
     {
-        if (word == sep) {
-
-            if (endIndex > startIndex) {
-                fseek(pFile, startIndex, SEEK_SET);
-                textChunk.resize(endIndex-startIndex);
-                fread(textChunk.data(), 1, textChunk.size(), pFile);
-                if (textChunk.length() >= min_chunk_len) dest.emplace_back(textChunk);
-                startIndex = endIndex + sep.length();
-                endIndex = startIndex;
-            } else {
-                endIndex++;
-                fseek(pFile, endIndex, SEEK_SET);
-            }
+        Close();
 
-        } else {
-            endIndex++;
-            fseek(pFile, endIndex, SEEK_SET);
+#ifndef _WIN32
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr != MAP_FAILED) {
+                madvise(addr, info.st_size, MADV_SEQUENTIAL);
+                fileData = (const char*)addr;
+                fileSize = info.st_size;
+                isMapped = true;
+            }
         }
+
+        close(fd);
+
+        if (isMapped) return true;
+#endif
+        if (!ReadFileInto(filename, fileBuffer)) return false;
+
+        fileData = fileBuffer.data();
+        fileSize = fileBuffer.size();
+        return true;
+    }
+
+    void Close()
+    {
+#ifndef _WIN32
+        if (isMapped) munmap((void*)fileData, fileSize);
+#endif
+        fileBuffer.clear();
+        fileBuffer.shrink_to_fit();
+        fileData = nullptr;
+        fileSize = 0;
+        isMapped = false;
     }
 
-    if (dest.empty()) {
-        dest.emplace_back(ReadFileStr(filename));
-    } else if (endIndex > startIndex) {
-        size_t chunkLen = FileSize(filename) - startIndex;
-        if (chunkLen > min_chunk_len) {
-            fseek(pFile, startIndex, SEEK_SET);
-            textChunk.resize(chunkLen);
-            fread(textChunk.data(), 1, textChunk.size(), pFile);
-            dest.emplace_back(textChunk);
+    const char* Data() const { return fileData; }
+    size_t Size() const { return fileSize; }
+    std::string_view View() const { return std::string_view(fileData, fileSize); }
+
+private:
+    const char* fileData;
+    size_t fileSize;
+    std::string fileBuffer;
+    bool isMapped;
+};
+
+inline size_t FindStr(std::string_view text, std::string_view str, size_t pos=0)
+{
+    if (str.empty()) return (pos <= text.size()) ? pos : std::string_view::npos;
+
+    const char first = str[0];
+
+    while (pos + str.size() <= text.size())
+    {
+        // memchr is vectorized by libc, only candidates get a full compare
+        const char* hit = (const char*)memchr(text.data() + pos, first, text.size() - pos - str.size() + 1);
+        if (hit == nullptr) break;
+
+        if (memcmp(hit + 1, str.data() + 1, str.size() - 1) == 0)
+            return hit - text.data();
+
+        pos = (hit - text.data()) + 1;
+    }
+
+    return std::string_view::npos;
+}
+
+inline void SplitTextView(std::string_view text, std::string_view sep,
+                          std::vector<std::string_view>& dest, size_t min_chunk_len=2)
+{
+    size_t destSize = dest.size();
+    size_t startIndex = 0;
+    size_t endIndex = 0;
+
+    if (!sep.empty()) {
+        while ((endIndex = FindStr(text, sep, startIndex)) != std::string_view::npos)
+        {
+            if (endIndex - startIndex >= min_chunk_len)
+                dest.emplace_back(text.substr(startIndex, endIndex - startIndex));
+
+            startIndex = endIndex + sep.size();
         }
     }
 
-    fclose(pFile);
+    if (dest.size() == destSize) {
+        dest.emplace_back(text);
+    } else if (text.size() - startIndex >= min_chunk_len) {
+        dest.emplace_back(text.substr(startIndex));
+    }
+}
+
+// chunks point into the mapped file and stay valid until it is closed
+inline void SplitTextFile(const MappedFile& file, const std::string& sep,
+                          std::vector<std::string_view>& dest, size_t min_chunk_len=2)
+{
+    SplitTextView(file.View(), sep, dest, min_chunk_len);
+}
+
+inline void SplitTextFile(const std::string& filename, const std::string& sep,
+                          std::vector<std::string>& dest, size_t min_chunk_len=2)
+{
+    MappedFile file(filename);
+    std::vector<std::string_view> chunks;
+
+    SplitTextView(file.View(), sep, chunks, min_chunk_len);
+
+    dest.reserve(dest.size() + chunks.size());
+
+    for (const std::string_view& chunk : chunks) dest.emplace_back(chunk);
 }
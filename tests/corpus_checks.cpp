@@ -0,0 +1,488 @@
+#include <random>
+#include "Worderizer.h"
+
+// Checks the corpus and vocabulary paths against simple serial references: the parallel GenEnglishWordMap
+// counts, EstimateWordMap, GenEnglishWordMapAlt, the Aho-Corasick counts of CountWordsInFiles, TokenizeFiles,
+// DecompressReader, SetMapIndicesTopK and SequencePacker.
+// Small task sizes and maps make every path split its work the way it does on a large corpus.
+
+using namespace Worderizer;
+
+typedef phmap::parallel_flat_hash_map<std::u32string, uint32_t> WordMap;
+
+static size_t failCount = 0;
+
+static void Check(bool same, const std::string& path)
+{
+    if (same) return;
+    if (failCount++ < 10) std::cout << path << " differs" << std::endl;
+}
+
+static std::u32string RandomString(std::mt19937& rng, const std::u32string& alphabet, size_t max_length)
+{
+    std::u32string result;
+    size_t length = rng() % (max_length + 1);
+
+    for (size_t i=0; i < length; ++i)
+        result.push_back(alphabet[rng() % alphabet.size()]);
+
+    return result;
+}
+
+// text made of a small set of words, so counts are high and patterns repeat and overlap
+static std::string RandomText(std::mt19937& rng, size_t length)
+{
+    static const std::vector<std::string> pieces = { "the ", "then ", "hello ", "abab", "aba ", "中文 ", "é ", "12345 ",
+                                                     "42 ", ", ", ". ", "\n", "\n\n", "\t", "x", "  " };
+    std::string result;
+
+    while (result.size() < length) result += pieces[rng() % pieces.size()];
+
+    return result;
+}
+
+static uint64_t NaiveCount(const std::string& text, const std::string& pattern)
+{
+    uint64_t count = 0;
+
+    if (pattern.empty()) return 0;
+
+    for (size_t pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + 1)) count++;
+
+    return count;
+}
+
+static std::string ReadAll(DecompressReader& stream)
+{
+    std::string result;
+
+    while (const std::string* chunk = stream.Next()) result += *chunk;
+
+    return result;
+}
+
+#ifdef WORDERIZER_USE_ZLIB
+static std::string GzipCompress(const std::string& data)
+{
+    z_stream stream = {};
+    std::string result(compressBound(data.size()) + 64, '\0');
+
+    // 15+16 writes a gzip header instead of a zlib one
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    stream.next_in = (Bytef*)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = (Bytef*)result.data();
+    stream.avail_out = result.size();
+    deflate(&stream, Z_FINISH);
+    result.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    return result;
+}
+#endif
+
+#ifdef WORDERIZER_USE_ZSTD
+static std::string ZstdCompress(const std::string& data)
+{
+    std::string result(ZSTD_compressBound(data.size()), '\0');
+    result.resize(ZSTD_compress(result.data(), result.size(), data.data(), data.size(), 3));
+    return result;
+}
+#endif
+
+// the corpus counted serially, one whole file at a time with a fresh word state
+static WordMap ReferenceWordCounts(const std::vector<std::string>& texts)
+{
+    WordMap result;
+
+    AddBaseChars(result);
+
+    for (const std::string& text : texts)
+    {
+        std::u32string fileText(U8ToU32(text));
+        WordState wordState;
+        CountWords(fileText.data(), fileText.length(), result, wordState);
+    }
+
+    return result;
+}
+
+static void CheckCorpus(std::mt19937& rng, const std::filesystem::path& dir)
+{
+    std::vector<std::string> texts;
+    std::vector<std::string> files;
+
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    // a few large files that get cut into ranges and many small ones that get batched
+    for (size_t f=0; f < 24; ++f)
+    {
+        texts.push_back(RandomText(rng, (f < 3) ? 200000 + rng() % 100000 : rng() % 3000));
+        files.push_back((dir / ("file" + std::to_string(f) + ".txt")).string());
+        WriteFileStr(files.back(), texts.back());
+    }
+
+    // a file without any whitespace is one range whatever the cut points are
+    texts.push_back(std::string(50000, 'a'));
+    files.push_back((dir / "nospace.txt").string());
+    WriteFileStr(files.back(), texts.back());
+
+#ifdef WORDERIZER_USE_ZLIB
+    WriteFileStr((dir / "file0.gz").string(), GzipCompress(texts[0]));
+    texts.push_back(texts[0]);
+#endif
+#ifdef WORDERIZER_USE_ZSTD
+    WriteFileStr((dir / "file1.zst").string(), ZstdCompress(texts[1]));
+    texts.push_back(texts[1]);
+#endif
+
+    WordMap expected(ReferenceWordCounts(texts));
+
+    for (uint64_t taskSize : { 4096, 65536, 0 })
+    {
+        WordMap counts;
+        TaskSize = taskSize;
+        PresizeMinBytes = (taskSize == 4096) ? 0 : 256*1024*1024;
+        LocalCountWords = (taskSize == 4096) ? 16 : 256*1024;
+
+        std::cout.setstate(std::ios::failbit);
+        GenEnglishWordMap(counts, dir.string(), false);
+        std::cout.clear();
+
+        Check(counts == expected, "GenEnglishWordMap with task size " + std::to_string(taskSize));
+
+        // patterns that cross the range cuts, overlap themselves or never occur
+        std::vector<std::u32string> patterns = { U"the", U"then", U"abab", U"ba", U"a", U"aaaa", U"中文", U"é 1",
+                                                 U"\n\n", U"zzz", U"the", U"" };
+        std::vector<uint64_t> patternCounts(CountWordsInFiles(patterns, files));
+
+        for (size_t p=0; p < patterns.size(); ++p)
+        {
+            uint64_t expectedCount = 0;
+
+            // only the plain files are scanned, they come first in texts
+            for (size_t f=0; f < files.size(); ++f) expectedCount += NaiveCount(texts[f], U32ToU8(patterns[p]));
+
+            Check(p < patternCounts.size() && patternCounts[p] == expectedCount,
+                  "CountWordsInFiles \"" + U32ToU8(patterns[p]) + "\" with task size " + std::to_string(taskSize));
+        }
+    }
+
+    // sampling every range reads the whole corpus, compressed files included, so the estimate is exact
+    {
+        WordMap estimate;
+
+        std::cout.setstate(std::ios::failbit);
+        SampleEstimate result(EstimateWordMap(estimate, dir.string(), 1.0, 1, 0, 4096, false));
+        std::cout.clear();
+
+        Check(estimate == expected && result.sampledBytes == result.totalBytes, "EstimateWordMap sampling everything");
+    }
+
+    // GenEnglishWordMapAlt counts the files each word appears in
+    {
+        WordMap fileCounts, expectedFileCounts;
+
+        for (const std::string& text : texts)
+        {
+            WordMap fileWords;
+            std::u32string fileText(U8ToU32(text));
+            WordState wordState;
+
+            CountWords(fileText.data(), fileText.length(), fileWords, wordState);
+
+            for (const auto& n : fileWords) expectedFileCounts[n.first]++;
+        }
+
+        std::cout.setstate(std::ios::failbit);
+        GenEnglishWordMapAlt(fileCounts, dir.string(), false);
+        std::cout.clear();
+
+        Check(fileCounts == expectedFileCounts, "GenEnglishWordMapAlt");
+    }
+
+    // a file that isn't valid UTF8 past its first range is skipped by TokenizeFiles, the others match a single pass
+    std::string invalidText(RandomText(rng, 20000));
+    invalidText[15000] = '\xFF';
+    WriteFileStr((dir / "invalid.txt").string(), invalidText);
+
+    WordMap words;
+    std::vector<std::string> inFiles(ListFiles(dir.string()));
+    std::vector<std::string> outFiles;
+
+    std::cout.setstate(std::ios::failbit);
+    GenEnglishWordMap(words, dir.string());
+    std::cout.clear();
+
+    std::filesystem::create_directories(dir / "out");
+
+    for (const std::string& file : inFiles)
+        outFiles.push_back((dir / "out" / std::filesystem::path(file).filename()).string());
+
+    TaskSize = 4096;
+
+    std::cout.setstate(std::ios::failbit);
+    TokenizeFiles(inFiles, outFiles, words);
+    std::cout.clear();
+
+    for (size_t f=0; f < inFiles.size(); ++f)
+    {
+        std::string text(ReadFileStr(inFiles[f]));
+        std::string output(ReadFileStr(outFiles[f]));
+        std::vector<uint32_t> expectedTokens;
+
+        if (DetectCompression(text.data(), text.size()) != CompressNone || text == invalidText) {
+            Check(!std::filesystem::exists(outFiles[f]), "TokenizeFiles skipping " + inFiles[f]);
+            continue;
+        }
+
+        StrToTokens(U8ToU32(text), expectedTokens, words);
+        Check(output.size() == expectedTokens.size() * sizeof(uint32_t) &&
+              memcmp(output.data(), expectedTokens.data(), output.size()) == 0, "TokenizeFiles on " + inFiles[f]);
+    }
+
+    TaskSize = 0;
+    PresizeMinBytes = 256*1024*1024;
+    LocalCountWords = 256*1024;
+
+    std::filesystem::remove_all(dir);
+}
+
+static void CheckDecompress(std::mt19937& rng)
+{
+    std::string text(RandomText(rng, 100000));
+
+    // plain data comes out unchanged whatever the chunk size
+    for (size_t chunkSize : { 1, 7, 4096, 1 << 20 })
+    {
+        DecompressReader stream(text, chunkSize);
+        Check(ReadAll(stream) == text && stream.Ok(), "DecompressReader on plain data, chunk size " + std::to_string(chunkSize));
+    }
+
+    {
+        DecompressReader stream("");
+        Check(ReadAll(stream).empty() && stream.Ok(), "DecompressReader on empty data");
+    }
+
+#ifdef WORDERIZER_USE_ZLIB
+    std::string gzip(GzipCompress(text));
+    std::string twoMembers(gzip + GzipCompress("second member"));
+
+    for (size_t chunkSize : { 7, 4096, 1 << 20 })
+    {
+        DecompressReader stream(gzip, chunkSize);
+        Check(ReadAll(stream) == text && stream.Ok(), "DecompressReader on gzip, chunk size " + std::to_string(chunkSize));
+    }
+
+    {
+        DecompressReader stream(twoMembers, 4096);
+        Check(ReadAll(stream) == text + "second member" && stream.Ok(), "DecompressReader on concatenated gzip members");
+    }
+
+    {
+        DecompressReader stream(std::string_view(gzip.data(), gzip.size() / 2), 4096);
+        ReadAll(stream);
+        Check(!stream.Ok(), "DecompressReader on truncated gzip");
+    }
+
+    {
+        WordMap counts, expected;
+        WordState wordState;
+        DecompressReader stream(gzip, 1000);
+        std::u32string fileText(U8ToU32(text));
+
+        CountWords(fileText.data(), fileText.length(), expected, wordState);
+        Check(CountWordsInStream(stream, counts) && counts == expected, "CountWordsInStream");
+    }
+
+    {
+        // the stream is dropped before it is read to the end
+        DecompressReader stream(gzip, 16);
+        stream.Next();
+    }
+#endif
+
+#ifdef WORDERIZER_USE_ZSTD
+    std::string zstd(ZstdCompress(text));
+
+    for (size_t chunkSize : { 7, 4096, 1 << 20 })
+    {
+        DecompressReader stream(zstd, chunkSize);
+        Check(ReadAll(stream) == text && stream.Ok(), "DecompressReader on zstd, chunk size " + std::to_string(chunkSize));
+    }
+
+    {
+        DecompressReader stream(std::string_view(zstd.data(), zstd.size() / 2), 4096);
+        ReadAll(stream);
+        Check(!stream.Ok(), "DecompressReader on truncated zstd");
+    }
+#endif
+}
+
+// keeps the pinned words and printable ASCII singles, then the most frequent others, indices follow the order
+static WordMap ReferenceTopK(const WordMap& words, size_t max_words, const std::vector<std::u32string>& pinned_words)
+{
+    std::vector<std::pair<uint32_t, std::u32string>> keep, others;
+    WordMap counts(words);
+    WordMap result;
+
+    for (const std::u32string& word : pinned_words)
+        if (!word.empty()) counts.try_emplace(word, 0);
+
+    for (const auto& n : counts)
+    {
+        bool isPinned = (n.first.length() == 1 && n.first[0] > 31 && n.first[0] < 127) ||
+            std::find(pinned_words.begin(), pinned_words.end(), n.first) != pinned_words.end();
+
+        (isPinned ? keep : others).push_back({ n.second, n.first });
+    }
+
+    auto moreFrequent = [](const auto& a, const auto& b) {
+        return (a.first != b.first) ? a.first > b.first : a.second < b.second;
+    };
+
+    std::sort(others.begin(), others.end(), moreFrequent);
+    others.resize(std::min(others.size(), (keep.size() < max_words) ? max_words - keep.size() : 0));
+
+    keep.insert(keep.end(), others.begin(), others.end());
+    std::sort(keep.begin(), keep.end(), moreFrequent);
+
+    for (size_t i=0; i < keep.size(); ++i) result[keep[i].second] = i;
+
+    return result;
+}
+
+static void CheckTopK(std::mt19937& rng)
+{
+    for (size_t t=0; t < 200; ++t)
+    {
+        WordMap words;
+        std::vector<std::u32string> pinned = { U"<|endoftext|>", U"<|pad|>" };
+        size_t wordCount = (t % 10 == 0) ? 20000 : rng() % 300;
+
+        for (size_t i=0; i < wordCount; ++i)
+            words[RandomString(rng, U"abcdefgh é中", 5)] = rng() % ((t % 2) ? 4 : 1000);
+
+        for (char32_t c=32; c < 127; ++c)
+            if (rng() % 2) words[std::u32string(1, c)] = rng() % 10;
+
+        words.erase(U"");
+        if (rng() % 2) words[U"<|pad|>"] = rng() % 100;
+        if (!words.empty()) pinned.push_back(words.begin()->first);
+
+        size_t maxWords = rng() % (words.size() + 200);
+        WordMap expected(ReferenceTopK(words, maxWords, pinned));
+
+        SetMapIndicesTopK(words, maxWords, pinned);
+        Check(words == expected, "SetMapIndicesTopK with " + std::to_string(wordCount) + " words, keeping " + std::to_string(maxWords));
+    }
+}
+
+static void CheckSequencePacker(std::mt19937& rng)
+{
+    const uint32_t sepToken = 999999;
+    const uint32_t padToken = 888888;
+    const std::u32string alphabet(U"helowrd0123456789 .,!?\n\tabcxyzq\x01é中");
+    WordMap words;
+
+    for (char32_t c=32; c < 127; ++c)
+        if (c != 'q') words.emplace(std::u32string(1, c), words.size());
+
+    for (size_t i=0; i < 300; ++i)
+        words.emplace(RandomString(rng, U"helowrdabcxyz0123456789 .é", 6), words.size());
+
+    words.erase(U"");
+
+    FastTokenTables fastTables(words);
+
+    for (size_t t=0; t < 300; ++t)
+    {
+        size_t seqLen = 1 + rng() % 50;
+        size_t seqCount = 1 + rng() % 5;
+        std::vector<std::u32string> docs;
+
+        for (size_t d=0; d < 30; ++d) docs.push_back(RandomString(rng, alphabet, (rng() % 4 == 0) ? 400 : 30));
+
+        docs.push_back(U"\x01q");
+        docs.push_back(U"");
+        std::shuffle(docs.begin(), docs.end(), rng);
+
+        // the reference packs the StrToTokens output of each document followed by the separator
+        std::vector<uint32_t> expected, expectedMask;
+        std::vector<char> docStarts;
+
+        for (const std::u32string& doc : docs)
+        {
+            std::vector<uint32_t> tokens;
+            StrToTokens(doc, tokens, words);
+            if (tokens.empty()) continue;
+            tokens.push_back(sepToken);
+
+            for (size_t i=0; i < tokens.size(); ++i)
+            {
+                expected.push_back(tokens[i]);
+                docStarts.push_back(i == 0);
+            }
+        }
+
+        uint32_t docNumber = 0;
+
+        for (size_t i=0; i < expected.size(); ++i)
+        {
+            if (i % seqLen == 0) {
+                docNumber = 1;
+            } else if (docStarts[i]) {
+                docNumber++;
+            }
+
+            expectedMask.push_back(docNumber);
+        }
+
+        while (expected.size() % seqLen != 0)
+        {
+            expected.push_back(padToken);
+            expectedMask.push_back(0);
+        }
+
+        SequencePacker packer(seqLen, sepToken, padToken);
+        std::vector<uint32_t> buffer(seqLen * seqCount), mask(seqLen * seqCount), packed, packedMask;
+        bool useFast = (t % 2 == 0);
+
+        auto consume = [&](size_t sequences) {
+            packed.insert(packed.end(), buffer.begin(), buffer.begin() + sequences * seqLen);
+            packedMask.insert(packedMask.end(), mask.begin(), mask.begin() + sequences * seqLen);
+            packer.SetBuffer(buffer.data(), mask.data(), seqCount);
+        };
+
+        packer.SetBuffer(buffer.data(), mask.data(), seqCount);
+
+        for (const std::u32string& doc : docs)
+        {
+            packer.AddDocument(doc, words, &GetThreadWordCache(), useFast ? &fastTables : nullptr);
+
+            while (packer.Full()) consume(seqCount);
+        }
+
+        consume(packer.Flush());
+
+        Check(packed == expected && packedMask == expectedMask && packer.CarriedTokens() == 0,
+              "SequencePacker with length " + std::to_string(seqLen) + " and " + std::to_string(seqCount) + " sequences");
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+
+    ThreadCount = 4;
+
+    CheckCorpus(rng, std::filesystem::temp_directory_path() / ("worderizer_corpus_checks_" + std::to_string(getpid())));
+    CheckDecompress(rng);
+    CheckTopK(rng);
+    CheckSequencePacker(rng);
+
+    std::cout << failCount << " mismatches" << std::endl;
+
+    return (failCount == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,240 @@
+#include <random>
+#include "Worderizer.h"
+
+// Randomized check that every tokenization path gives the same tokens as a plain single pass:
+// the word cache, the dense lookup tables, a published Vocabulary, StrToTokensParallel, CountTokens
+// and the UTF8 block split of the CLI tokenize command. The reference below is the original StrToTokens loop.
+
+using namespace Worderizer;
+
+typedef phmap::parallel_flat_hash_map<std::u32string, uint32_t> WordMap;
+
+static bool ReferenceStrToTokens(const std::u32string& str, std::vector<uint32_t>& dest,
+                                 const WordMap& words, bool skip_unknowns)
+{
+    std::u32string word, nextWord, tempStr;
+    bool foundToken = false;
+    bool isNumber = false;
+    bool nextChar = false;
+    bool isFirstChar = true;
+    char32_t tempChar = 0;
+
+    if (str.empty()) return false;
+
+    std::u32string normStr(NormalizeChars(str));
+
+    for (size_t c=0; c < normStr.length(); ++c)
+    {
+        tempChar = normStr[c];
+
+        while(true)
+        {
+            if (UpdateWord(word, isFirstChar, isNumber, nextChar, tempChar)) {
+
+                isFirstChar = true;
+                foundToken = true;
+
+                if (!nextChar && word.length() == 1 && c < normStr.length()-1) {
+
+                    tempStr = word;
+                    tempStr.push_back(normStr[c+1]);
+
+                    if (words.contains(tempStr)) {
+                        dest.push_back(words.find(tempStr)->second);
+                        c++;
+                        break;
+                    }
+                }
+
+                while (!words.contains(word))
+                {
+                    nextWord.push_back(word.back());
+                    word.pop_back();
+
+                    if (word.length() == 0) {
+                        foundToken = false;
+                        break;
+                    }
+                }
+
+                if (foundToken) {
+                    dest.push_back(words.find(word)->second);
+                } else if (!skip_unknowns) {
+                    return false;
+                }
+
+                if (nextWord.length() > 0) {
+                    if (nextWord.length() > 1) {
+                        word.assign(nextWord.begin(), nextWord.end()-(!foundToken));
+                        std::reverse(word.begin(), word.end());
+                        isFirstChar = false;
+                    } else if (foundToken) {
+                        word = nextWord;
+                        isFirstChar = false;
+                    }
+
+                    nextWord.clear();
+                }
+
+                if (nextChar) {
+                    nextChar = false;
+                    continue;
+                }
+
+            }
+
+            break;
+        }
+    }
+
+    return !dest.empty();
+}
+
+// tokenizes UTF8 text in blocks cut at random positions moved back to a safe split, like the tokenize command
+static std::vector<uint32_t> BlockTokens(const std::string& text, const WordMap& words,
+                                         const FastTokenTables& fast, std::mt19937& rng)
+{
+    std::vector<uint32_t> result, tokens;
+    size_t blockStart = 0;
+
+    while (blockStart < text.size())
+    {
+        size_t splitPos = std::min(text.size(), blockStart + 1 + rng() % 64);
+
+        while (splitPos > blockStart && !IsSafeByteSplit(text.data(), text.size(), splitPos, words))
+            splitPos--;
+
+        if (splitPos == blockStart) splitPos = text.size();
+
+        tokens.clear();
+        StrToTokens(U8ToU32(text.substr(blockStart, splitPos - blockStart)), tokens, words, true, nullptr, &fast);
+        result.insert(result.end(), tokens.begin(), tokens.end());
+
+        blockStart = splitPos;
+    }
+
+    return result;
+}
+
+static std::u32string RandomString(std::mt19937& rng, const std::u32string& alphabet, size_t max_length)
+{
+    std::u32string result;
+    size_t length = rng() % (max_length + 1);
+
+    for (size_t i=0; i < length; ++i)
+        result.push_back(alphabet[rng() % alphabet.size()]);
+
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const size_t caseCount = (argc > 1) ? std::stoul(argv[1]) : 2000;
+    const std::u32string alphabet(U"helowrd0123456789 .,!?\n\tabcxyzq\x01éÿāÀÆ中");
+    const std::u32string skipAlphabet(U"helo1 .\n\n\t\x01\x01中中中中中中");
+
+    std::mt19937 rng(1);
+    WordMap words;
+    size_t failCount = 0;
+
+    // a few substitutions so both the normalized and the unchanged input paths are covered
+    charSubTable.resize(0x100);
+    charSubTable[0xC0].sub = U"A";
+    charSubTable[0xC0].use = true;
+    charSubTable[0xC6].sub = U"AE";
+    charSubTable[0xC6].use = true;
+
+    // every ASCII char except a few so unknown words occur, plus random longer words and numbers
+    for (char32_t c=32; c < 127; ++c)
+        if (c != 'q' && c != '7') words.emplace(std::u32string(1, c), words.size());
+
+    for (const std::u32string word : { U"\n\n", U". ", U" a", U"AE", U"123", U"1234", U"0042", U"999", U"éa" })
+        words.emplace(word, words.size());
+
+    for (size_t i=0; i < 300; ++i)
+        words.emplace(RandomString(rng, U"helowrdabcxyz0123456789 .é", 6), words.size());
+
+    words.erase(U"");
+
+    FastTokenTables fastTables(words);
+    WordCache cache;
+
+    // the tables are built before the last words are added, like LoadVocabulary() followed by edits,
+    // so tokenizing through the handle only matches if Publish() rebuilt them
+    std::unique_ptr<Vocabulary> vocab(new Vocabulary());
+    vocab->words = words;
+    for (char32_t c : U"0123456789") vocab->words.erase(std::u32string(1, c));
+    BuildTokenTable(vocab->words, vocab->tokenTable);
+    vocab->fastTables.Build(vocab->words);
+    vocab->words = words;
+
+    VocabHandle vocabHandle(std::move(vocab));
+    std::vector<std::u32string> tokenTable;
+    BuildTokenTable(words, tokenTable);
+
+    // short words so runs of skipped chars long enough to split after are common
+    MaxWordLen = 8;
+    ThreadCount = 4;
+
+    auto check = [&](bool same, const char* path, const std::u32string& str, bool skip_unknowns) {
+        if (same) return;
+        if (failCount++ < 10)
+            std::cout << path << " differs (skip_unknowns " << skip_unknowns << "): \"" << U32ToU8(str) << "\"" << std::endl;
+    };
+
+    for (size_t t=0; t < caseCount; ++t)
+    {
+        std::u32string str(RandomString(rng, (t % 3 == 0) ? skipAlphabet : alphabet, (t % 10 == 0) ? 2000 : 80));
+
+        for (bool skipUnknowns : { true, false })
+        {
+            std::vector<uint32_t> expected, tokens;
+            bool expectedResult = ReferenceStrToTokens(str, expected, words, skipUnknowns);
+            bool result;
+
+            result = StrToTokens(str, tokens, words, skipUnknowns);
+            check(result == expectedResult && tokens == expected, "StrToTokens", str, skipUnknowns);
+
+            tokens.clear();
+            result = StrToTokens(str, tokens, words, skipUnknowns, &cache);
+            check(result == expectedResult && tokens == expected, "StrToTokens with WordCache", str, skipUnknowns);
+
+            tokens.clear();
+            result = StrToTokens(str, tokens, words, skipUnknowns, nullptr, &fastTables);
+            check(result == expectedResult && tokens == expected, "StrToTokens with FastTokenTables", str, skipUnknowns);
+
+            tokens.clear();
+            result = StrToTokens(str, tokens, words, skipUnknowns, &cache, &fastTables);
+            check(result == expectedResult && tokens == expected, "StrToTokens with both", str, skipUnknowns);
+
+            tokens.clear();
+            result = StrToTokens(str, tokens, *vocabHandle.Read(), skipUnknowns, &cache);
+            check(result == expectedResult && tokens == expected, "StrToTokens with published Vocabulary", str, skipUnknowns);
+
+            std::u32string text, expectedText;
+            for (const uint32_t& token : expected) expectedText += tokenTable[token];
+            TokensToStr(text, expected, *vocabHandle.Read());
+            check(text == expectedText, "TokensToStr with published Vocabulary", str, skipUnknowns);
+
+            for (size_t minSegment : { 1, 7, 64 })
+            {
+                tokens.clear();
+                result = StrToTokensParallel(str, tokens, words, skipUnknowns, minSegment, &fastTables);
+                check(result == expectedResult && tokens == expected, "StrToTokensParallel", str, skipUnknowns);
+            }
+
+            if (!skipUnknowns) continue;
+
+            size_t limit = rng() % 20 + 1;
+
+            check(CountTokens(str, words) == expected.size(), "CountTokens", str, skipUnknowns);
+            check(CountTokens(str, words, 0, &cache, &fastTables) == expected.size(), "CountTokens with both", str, skipUnknowns);
+            check(CountTokens(str, words, limit) == std::min(expected.size(), limit + 1), "CountTokens with limit", str, skipUnknowns);
+            check(BlockTokens(U32ToU8(str), words, fastTables, rng) == expected, "Block split", str, skipUnknowns);
+        }
+    }
+
+    std::cout << caseCount << " cases, " << failCount << " mismatches" << std::endl;
+
+    return (failCount == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
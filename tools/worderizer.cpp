@@ -0,0 +1,523 @@
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include "Worderizer.h"
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+#else
+    #include <csignal>
+    #include "WorderizerServer.h"
+#endif
+
+struct CliOptions
+{
+    std::vector<std::string> args;
+    std::string charMap;
+    size_t blockSize;
+    size_t batchSize;
+    double sampleRate;
+    double timeBudget;
+    uint64_t seed;
+    bool altCount;
+    bool cleanMap;
+
+    CliOptions() : blockSize(4*1024*1024), batchSize(64), sampleRate(0), timeBudget(0),
+                   seed(1), altCount(false), cleanMap(false) {};
+};
+
+static void PrintUsage()
+{
+    std::cerr <<
+        "Usage: worderizer <command> [options]\n"
+        "\n"
+        "Commands:\n"
+        "  build <data_dir> <map_file>   generate a word map from the text files in data_dir\n"
+        "  clean <map_file> [out_file]   remove repetitive nonsense words from a word map\n"
+        "  tokenize <map_file>           read UTF8 text from stdin, write uint32 tokens to stdout\n"
+        "  detokenize <map_file>         read uint32 tokens from stdin, write UTF8 text to stdout\n"
+        "  pretokenize <map_file> <data_dir> <out_dir>\n"
+        "                                tokenize every file in data_dir into out_dir/<name>.bin\n"
+        "  stats <map_file>              print information about a word map\n"
+        "  serve <map_file> <socket>     serve tokenize/detokenize requests on a Unix socket,\n"
+        "                                SIGHUP reloads the word map without a restart\n"
+        "\n"
+        "Options:\n"
+        "  --min-occurr N       min occurences to keep word (build)\n"
+        "  --max-word-len N     max word length (build, tokenize)\n"
+        "  --max-num-len N      max digits per number token (build, tokenize)\n"
+        "  --max-char-code N    max character code (build, tokenize)\n"
+        "  --top-k N            keep only the N most frequent words (build)\n"
+        "  --alt                count words once per file (build)\n"
+        "  --clean              clean the word map before saving (build)\n"
+        "  --huge-pages         back large count tables with transparent huge pages (build)\n"
+        "  --sample RATE        estimate from a random fraction of the corpus (build)\n"
+        "  --seed N             random seed for --sample (build)\n"
+        "  --time-budget SEC    keep sampling until SEC seconds have passed (build)\n"
+        "  --char-map FILE      character substitution config (tokenize, pretokenize)\n"
+        "  --threads N          worker thread count, 0 uses every core\n"
+        "  --task-size BYTES    bytes per scheduled file task, 0 picks a size (build, pretokenize)\n"
+        "  --block-size BYTES   stdin block size for tokenize/detokenize\n"
+        "  --batch N            max requests a server worker handles at once (serve)\n"
+        "\n"
+        "Tokens are written and read as uint32 values in native byte order." << std::endl;
+}
+
+static CliOptions ParseOptions(int argc, char* argv[])
+{
+    CliOptions options;
+
+    for (int i=2; i < argc; ++i)
+    {
+        std::string arg(argv[i]);
+
+        if (!StrStartsWith(arg, "--")) {
+            options.args.push_back(arg);
+            continue;
+        }
+
+        if (arg == "--alt") {
+            options.altCount = true;
+            continue;
+        } else if (arg == "--clean") {
+            options.cleanMap = true;
+            continue;
+        } else if (arg == "--huge-pages") {
+            Worderizer::UseHugePages = true;
+            continue;
+        }
+
+        if (i+1 >= argc) HandleFatalError("Missing value for " + arg);
+
+        std::string value(argv[++i]);
+
+        try {
+            if (arg == "--min-occurr") {
+                Worderizer::MinOccurr = std::stoul(value);
+            } else if (arg == "--max-word-len") {
+                Worderizer::MaxWordLen = std::stoul(value);
+            } else if (arg == "--max-num-len") {
+                Worderizer::MaxNumLen = std::stoul(value);
+            } else if (arg == "--max-char-code") {
+                Worderizer::MaxCharCode = std::stoul(value);
+            } else if (arg == "--top-k") {
+                Worderizer::MaxVocabSize = std::stoul(value);
+            } else if (arg == "--threads") {
+                Worderizer::ThreadCount = std::stoul(value);
+            } else if (arg == "--task-size") {
+                Worderizer::TaskSize = std::stoull(value);
+            } else if (arg == "--block-size") {
+                options.blockSize = std::max<size_t>(64, std::stoull(value));
+            } else if (arg == "--sample") {
+                options.sampleRate = std::stod(value);
+            } else if (arg == "--seed") {
+                options.seed = std::stoull(value);
+            } else if (arg == "--time-budget") {
+                options.timeBudget = std::stod(value);
+            } else if (arg == "--batch") {
+                options.batchSize = std::stoul(value);
+            } else if (arg == "--char-map") {
+                options.charMap = value;
+            } else {
+                HandleFatalError("Unknown option " + arg);
+            }
+        } catch (std::logic_error&) {
+            HandleFatalError("Invalid value for " + arg + ": " + value);
+        }
+    }
+
+    return options;
+}
+
+static void RequireArgs(const CliOptions& options, size_t count)
+{
+    if (options.args.size() < count) {
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void WriteOutput(const std::string& data)
+{
+    if (fwrite(data.data(), 1, data.size(), stdout) != data.size())
+        HandleFatalError("Failed to write to stdout");
+}
+
+// keeps up to one block per worker in flight and writes results in input order,
+// a fixed set of workers runs the blocks so their thread local word caches are reused
+class OrderedPipeline
+{
+public:
+    OrderedPipeline() : maxPending(Worderizer::GetThreadCount()), stopWorkers(false)
+    {
+        for (size_t i=0; i < maxPending; ++i)
+            workerThreads.emplace_back(&OrderedPipeline::WorkerLoop, this);
+    }
+
+    ~OrderedPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopWorkers = true;
+        }
+
+        jobCond.notify_all();
+        for (std::thread& thread : workerThreads) thread.join();
+    }
+
+    template <typename Work>
+    void Push(Work&& work)
+    {
+        if (pendingBlocks.size() >= maxPending) PopFront();
+
+        std::packaged_task<std::string()> job(std::forward<Work>(work));
+        pendingBlocks.push_back(job.get_future());
+
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            queuedJobs.push_back(std::move(job));
+        }
+
+        jobCond.notify_one();
+    }
+
+    void Finish()
+    {
+        while (!pendingBlocks.empty()) PopFront();
+
+        fflush(stdout);
+    }
+
+private:
+    std::deque<std::future<std::string>> pendingBlocks;
+    std::deque<std::packaged_task<std::string()>> queuedJobs;
+    std::vector<std::thread> workerThreads;
+    std::mutex jobMutex;
+    std::condition_variable jobCond;
+    size_t maxPending;
+    bool stopWorkers;
+
+    void PopFront()
+    {
+        WriteOutput(pendingBlocks.front().get());
+        pendingBlocks.pop_front();
+    }
+
+    void WorkerLoop()
+    {
+        while (true)
+        {
+            std::packaged_task<std::string()> job;
+
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobCond.wait(lock, [this] { return !queuedJobs.empty() || stopWorkers; });
+
+                if (queuedJobs.empty()) return;
+
+                job = std::move(queuedJobs.front());
+                queuedJobs.pop_front();
+            }
+
+            job();
+        }
+    }
+};
+
+static std::u32string DecodeBlock(const std::string& block)
+{
+    // std::wstring_convert keeps state so every worker thread needs its own
+    thread_local std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> converter;
+
+    try {
+        return converter.from_bytes(block.data(), block.data() + block.size());
+    } catch (std::range_error&) {
+        HandleFatalError("Input is not valid UTF8");
+    }
+
+    return std::u32string();
+}
+
+static int RunBuild(const CliOptions& options)
+{
+    RequireArgs(options, 2);
+
+    phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+
+    if (options.sampleRate > 0) {
+        Worderizer::EstimateWordMap(words, options.args[0], options.sampleRate, options.seed, options.timeBudget);
+    } else if (options.altCount) {
+        Worderizer::GenEnglishWordMapAlt(words, options.args[0]);
+    } else {
+        Worderizer::GenEnglishWordMap(words, options.args[0]);
+    }
+
+    if (options.cleanMap) Worderizer::CleanWordMap(words);
+
+    Worderizer::SaveWordMap(words, options.args[1]);
+    return EXIT_SUCCESS;
+}
+
+static int RunClean(const CliOptions& options)
+{
+    RequireArgs(options, 1);
+
+    phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+
+    Worderizer::LoadWordMap(words, options.args[0]);
+    Worderizer::CleanWordMap(words);
+    Worderizer::SaveWordMap(words, options.args.size() > 1 ? options.args[1] : options.args[0]);
+    return EXIT_SUCCESS;
+}
+
+static int RunTokenize(const CliOptions& options)
+{
+    RequireArgs(options, 1);
+
+    phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+    OrderedPipeline pipeline;
+    std::string block, carry;
+    const size_t maxCarry = options.blockSize * 16;
+    bool warnedCut = false;
+
+    Worderizer::LoadWordMap(words, options.args[0]);
+
+    if (!options.charMap.empty()) Worderizer::LoadSubChars(options.charMap);
+
+    Worderizer::FastTokenTables fastTables(words);
+
+    while (true)
+    {
+        block.swap(carry);
+        carry.clear();
+
+        size_t oldSize = block.size();
+        block.resize(oldSize + options.blockSize);
+        block.resize(oldSize + fread(block.data() + oldSize, 1, options.blockSize, stdin));
+
+        bool endOfInput = (block.size() == oldSize);
+
+        if (!endOfInput) {
+
+            // cut where tokenizing both halves separately matches a single pass over all input,
+            // the carry was searched before so only the new bytes and the char they may complete are checked
+            size_t scanFloor = (oldSize > 4) ? oldSize - 4 : 0;
+            size_t splitPos = block.size() - 1;
+
+            while (splitPos > scanFloor && !Worderizer::IsSafeByteSplit(block.data(), block.size(), splitPos, words))
+                splitPos--;
+
+            if (splitPos == scanFloor && block.size() >= maxCarry) {
+                // input without a safe split for this long is cut at a char boundary anyway
+                splitPos = block.size() - 1;
+                while (splitPos > 0 && ((uint8_t)block[splitPos] & 0xC0) == 0x80) splitPos--;
+
+                if (!warnedCut) std::cerr << "No safe split point in " << block.size() << " bytes, tokens at forced cuts may differ from a single pass" << std::endl;
+                warnedCut = true;
+            } else if (splitPos == scanFloor) {
+                splitPos = 0;
+            }
+
+            if (splitPos == 0) {
+                carry.swap(block);
+                continue;
+            }
+
+            carry.assign(block, splitPos, std::string::npos);
+            block.resize(splitPos);
+        }
+
+        if (!block.empty()) {
+            pipeline.Push([&words, &fastTables, text = std::move(block)] {
+                std::vector<uint32_t> tokens;
+                Worderizer::StrToTokens(DecodeBlock(text), tokens, words, true, &Worderizer::GetThreadWordCache(), &fastTables);
+                return std::string((const char*)tokens.data(), tokens.size() * sizeof(uint32_t));
+            });
+        }
+
+        block.clear();
+
+        if (endOfInput) break;
+    }
+
+    pipeline.Finish();
+    return EXIT_SUCCESS;
+}
+
+static int RunPretokenize(const CliOptions& options)
+{
+    RequireArgs(options, 3);
+
+    phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+    std::vector<std::string> files(ListFiles(options.args[1]));
+    std::vector<std::string> outFiles;
+
+    Worderizer::LoadWordMap(words, options.args[0]);
+
+    if (!options.charMap.empty()) Worderizer::LoadSubChars(options.charMap);
+
+    if (!DirExists(options.args[2]) && !CreateDir(options.args[2]))
+        HandleFatalError("Couldn't create directory: " + options.args[2]);
+
+    for (const std::string& file : files)
+        outFiles.push_back((std::filesystem::path(options.args[2]) / std::filesystem::path(file).filename()).string() + ".bin");
+
+    Worderizer::TokenizeFiles(files, outFiles, words);
+    return EXIT_SUCCESS;
+}
+
+static int RunDetokenize(const CliOptions& options)
+{
+    RequireArgs(options, 1);
+
+    phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+    std::vector<std::u32string> tokenTable;
+    OrderedPipeline pipeline;
+    std::vector<uint32_t> tokens;
+    size_t blockTokens = options.blockSize / sizeof(uint32_t);
+
+    Worderizer::LoadWordMap(words, options.args[0]);
+    Worderizer::BuildTokenTable(words, tokenTable);
+
+    while (true)
+    {
+        tokens.resize(blockTokens);
+        tokens.resize(fread(tokens.data(), sizeof(uint32_t), blockTokens, stdin));
+
+        if (tokens.empty()) break;
+
+        pipeline.Push([&tokenTable, block = std::move(tokens)] {
+            thread_local std::wstring_convert<std::codecvt_utf8<char32_t>,char32_t> converter;
+            std::u32string text;
+            Worderizer::TokensToStr(text, block, tokenTable);
+            return converter.to_bytes(text);
+        });
+
+        tokens.clear();
+    }
+
+    pipeline.Finish();
+    return EXIT_SUCCESS;
+}
+
+static int RunStats(const CliOptions& options)
+{
+    RequireArgs(options, 1);
+
+    phmap::parallel_flat_hash_map<std::u32string, uint32_t> words;
+    size_t alphaWords = 0, numberWords = 0, singleChars = 0, specialPairs = 0;
+    size_t totalLen = 0, maxLen = 0;
+
+    Worderizer::LoadWordMap(words, options.args[0]);
+
+    for (const auto& n : words)
+    {
+        totalLen += n.first.length();
+        maxLen = std::max(maxLen, n.first.length());
+
+        if (n.first.length() == 1) {
+            singleChars++;
+        } else if (Worderizer::IsDigit(n.first[0])) {
+            numberWords++;
+        } else if (Worderizer::IsAlpha(n.first[0])) {
+            alphaWords++;
+        } else {
+            specialPairs++;
+        }
+    }
+
+    std::cout << "Tokens: " << words.size() << std::endl;
+    std::cout << "Single characters: " << singleChars << std::endl;
+    std::cout << "Alphabetical words: " << alphaWords << std::endl;
+    std::cout << "Numbers: " << numberWords << std::endl;
+    std::cout << "Special pairs: " << specialPairs << std::endl;
+    std::cout << "Average word length: " << (words.empty() ? 0.0 : (double)totalLen / words.size()) << std::endl;
+    std::cout << "Max word length: " << maxLen << std::endl;
+
+    Worderizer::PrintMemoryReport(Worderizer::GetMemoryReport(words, "Word map memory"));
+    return EXIT_SUCCESS;
+}
+
+#ifndef _WIN32
+static int RunServe(const CliOptions& options)
+{
+    RequireArgs(options, 2);
+
+    sigset_t serveSignals;
+    int signal = 0;
+
+    if (!options.charMap.empty()) Worderizer::LoadSubChars(options.charMap);
+
+    Worderizer::VocabHandle vocab(Worderizer::LoadVocabulary(options.args[0]));
+
+    // block the signals before any thread starts so only sigwait below receives them
+    sigemptyset(&serveSignals);
+    sigaddset(&serveSignals, SIGINT);
+    sigaddset(&serveSignals, SIGTERM);
+    sigaddset(&serveSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &serveSignals, nullptr);
+
+    Worderizer::TokenServer server(vocab, Worderizer::ThreadCount, options.batchSize);
+
+    if (!server.Start(options.args[1])) HandleFatalError("Failed to listen on " + options.args[1]);
+
+    std::cout << "Listening on " << options.args[1] << std::endl;
+
+    while (sigwait(&serveSignals, &signal) == 0 && signal == SIGHUP)
+    {
+        // workers keep serving from the old word map until the new one is published
+        vocab.Reload(options.args[0]);
+        std::cout << "Reloaded " << options.args[0] << " as version " << vocab.Version() << std::endl;
+    }
+
+    server.Stop();
+
+    std::cout << server.LatencyReport();
+    return EXIT_SUCCESS;
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    std::string command(argv[1]);
+    CliOptions options(ParseOptions(argc, argv));
+
+    if (command == "build") {
+        return RunBuild(options);
+    } else if (command == "clean") {
+        return RunClean(options);
+    } else if (command == "stats") {
+        return RunStats(options);
+    } else if (command == "pretokenize") {
+        return RunPretokenize(options);
+#ifndef _WIN32
+    } else if (command == "serve") {
+        return RunServe(options);
+#endif
+    }
+
+    // stdout carries binary data from here on so library messages go to stderr
+    std::cout.rdbuf(std::cerr.rdbuf());
+
+    if (command == "tokenize") {
+        return RunTokenize(options);
+    } else if (command == "detokenize") {
+        return RunDetokenize(options);
+    }
+
+    PrintUsage();
+    return EXIT_FAILURE;
+}